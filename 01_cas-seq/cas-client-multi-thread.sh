@@ -0,0 +1,36 @@
+#!/bin/bash
+# Program:
+#       Record data about cpu time and throughput with one multi-threaded client process
+#       Usage: ./cas-client-multi-thread.sh <threads> [cpu-list] [rdma-client options]
+
+ip=192.168.0.13
+port=12345
+
+if [ $# -lt 1 ]; then
+    echo "usage: $0 <threads> [cpu-list] [rdma-client options]"
+    exit 1
+fi
+
+threads=$1
+shift
+cpus=""
+if [ $# -ge 1 ]; then
+    cpus="-a $1"
+    shift
+fi
+
+if [ -f "data-cas-sequential" ]; then
+    rm data-cas-sequential
+fi
+
+for blocksize in 64 512 1024 2048 4096 16384 65536 131072
+do
+    i=5
+    while [ "$i" != "0" ]
+    do
+        ./rdma-client -t $threads $cpus "$@" read $ip $port $blocksize
+        i=$(($i-1))
+    done
+done
+
+exit 0
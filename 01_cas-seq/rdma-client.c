@@ -1,11 +1,15 @@
+#define _GNU_SOURCE
 #include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/resource.h>
 #include <time.h>
+#include <pthread.h>
 #include <rdma/rdma_cma.h>
 #include "get_clock.h"
+#include "region.h"
 
 #define TEST_NZ(x) do { if ( (x)) die("error: " #x " failed (returned non-zero)." ); } while (0)
 #define TEST_Z(x)  do { if (!(x)) die("error: " #x " failed (returned zero/null)."); } while (0)
@@ -13,29 +17,71 @@
 const int TIMEOUT_IN_MS = 500;
 unsigned long RDMA_BUFFER_SIZE = 1024 * 1024 * 1024;
 unsigned long RDMA_BLOCK_SIZE;
+int RDMA_QUEUE_DEPTH = 1;
+int RDMA_POST_BATCH = 1;
+int RDMA_SIGNAL_INTERVAL = 1;
+int RDMA_NUM_QPS = 1;
+int RDMA_NUM_CQS = 1;
+
+/* how the blocks of the region are split between the QPs */
+enum stripe
+{
+    STRIPE_RR,
+    STRIPE_SHARD
+};
+
+static const char *stripe_names[] = { "rr", "shard" };
+enum stripe RDMA_STRIPE = STRIPE_RR;
+
+/* cores the cq pollers are pinned to, round-robin; none means leave it to the scheduler */
+int *RDMA_CPUS = NULL;
+int RDMA_NUM_CPUS = 0;
 int offset = 0;
-char *point;
 unsigned long *rand_offset;
 
-cycles_t start, end;
+cycles_t launch, connect_start, first_byte, start, end;
 double cycles_to_units, sum_of_test_cycles;
+double cpu_start;
 
 struct connection_client
 {
     struct rdma_cm_id *id;
     struct ibv_qp *qp;
-    int connected;
+    struct ibv_cq *cq;
+    int index;
+    /* control sends made before ESTABLISHED wait in pending_sends until on_connect posts them */
+    enum
+    {
+        CONN_CONNECTING,
+        CONN_ESTABLISHED
+    } state;
+    pthread_mutex_t state_lock;
+    struct message *pending_sends;
+    int num_pending_sends;
+    double setup_cpu_us;
 
-    struct ibv_mr *rdma_local_mr;
     struct message *recv_msg;
     struct ibv_mr *recv_mr;
-    char *rdma_local_region;
 	
 	struct message *send_msg;
 	struct ibv_mr *send_mr;
 
     struct ibv_mr server_mr;
 
+    /* this QP reads blocks first_block, first_block + block_stride, ... */
+    unsigned long first_block;
+    unsigned long block_stride;
+    unsigned long num_blocks;
+    unsigned long bytes;
+    unsigned long posted_blocks;
+    unsigned long completed_blocks;
+    unsigned long cqes;
+    struct ibv_send_wr *read_wr;
+    struct ibv_sge *read_sge;
+    cycles_t start, end;
+    /* the first fill can run on the cm thread while this qp's poller already sees completions */
+    pthread_mutex_t fill_lock;
+
     enum
     {
         RS_INIT,
@@ -43,39 +89,88 @@ struct connection_client
     } recv_state;
 };
 
-struct message
+enum
 {
-    enum
-    {
-        MSG_MR,
-        MSG_DONE,
-    } type;
-
-    union {
-        struct ibv_mr mr;
-    } data;
+    MSG_MR,
+    MSG_DONE
 };
 
+#define MSG_VERSION 1
+#define MAX_PENDING_SENDS 4
+
+/* control message as it goes on the wire: fixed width, packed and small enough to send inline */
+struct message
+{
+    uint8_t version;
+    uint8_t type;
+    uint16_t reserved;
+    uint32_t rkey;
+    uint64_t addr;
+    uint32_t length;
+    uint32_t seq;
+    uint64_t index;
+} __attribute__((packed));
+
 struct context
 {
     struct ibv_context *ctx;
     struct ibv_pd *pd;
-    struct ibv_cq *cq;
-    struct ibv_comp_channel *comp_channel;
-    pthread_t cq_poller_thread;
+    struct ibv_device_attr dev_attr;
+
+    /* RDMA_NUM_CQS completion queues, each drained by its own poller */
+    struct ibv_cq **cqs;
+    struct ibv_comp_channel **comp_channels;
+    pthread_t *cq_poller_threads;
+
+    /* one landing region shared by all QPs, each writes only its own blocks */
+    struct region local_region;
+    char *rdma_local_region;
+    struct ibv_mr *rdma_local_mr;
+
+    struct connection_client **conns;
+    int num_conns;
+    int started_conns;
+    int finished_conns;
+    int disconnected_conns;
+    pthread_mutex_t lock;
 };
 
+#define CQ_BATCH_HIST_SIZE 16
+
+int CQ_POLL_BATCH = 16;
+unsigned long (*cq_batch_hist)[CQ_BATCH_HIST_SIZE];
+
+enum poll_mode
+{
+    POLL_EVENT,
+    POLL_BUSY,
+    POLL_HYBRID
+};
+
+static const char *poll_mode_names[] = { "event", "busy", "hybrid" };
+enum poll_mode CQ_POLL_MODE = POLL_EVENT;
+int CQ_SPIN_US = 50;
+
 static struct context *s_ctx = NULL;
 
 int on_addr_resolved(struct rdma_cm_id *id);
-int on_connection_client(struct rdma_cm_id *id);
+int on_connection_client(struct rdma_cm_id *id, const struct rdma_conn_param *param);
 int on_disconnect_client(struct rdma_cm_id *id);
 int on_event(struct rdma_cm_event *event);
+void post_message(struct connection_client *conn, struct message *msg);
 int on_route_resolved(struct rdma_cm_id *id);
 void usage(const char *argv0);
 void *poll_cq(void *context);
+void record_cq_batch(int cq, int n);
+void print_cq_batch_hist(void);
+int set_poll_mode(const char *name);
+double cpu_seconds(void);
 void destroy_connection_client(void *context);
 void on_connect_client(void *context);
+void on_read_finish(struct connection_client *conn);
+void set_server_mr(struct connection_client *conn, const struct message *msg);
+void start_reads(struct connection_client *conn);
+int parse_cpu_list(const char *list);
 
 void die(const char *reason)
 {
@@ -83,6 +178,14 @@ void die(const char *reason)
     exit(EXIT_FAILURE);
 }
 
+double thread_cpu_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
 void post_receives(struct connection_client *conn)
 {
     struct ibv_recv_wr wr, *bad_wr = NULL;
@@ -100,43 +203,57 @@ void post_receives(struct connection_client *conn)
     TEST_NZ(ibv_post_recv(conn->qp, &wr, &bad_wr));
 }
 
-int on_connection_client(struct rdma_cm_id *id)
+int on_connection_client(struct rdma_cm_id *id, const struct rdma_conn_param *param)
 {
-    on_connect_client(id->context);
+    struct connection_client *conn = (struct connection_client *)id->context;
+    const struct message *msg = param->private_data;
+
+    on_connect_client(conn);
+
+    /* the server handed its region over with the accept, so there is no MSG_MR to wait for */
+    if (param->private_data_len >= sizeof(struct message) && msg->version == MSG_VERSION && msg->type == MSG_MR)
+    {
+        set_server_mr(conn, msg);
+        start_reads(conn);
+    }
     return 0;
 }
 
 void register_memory_client(struct connection_client *conn)
 {
     conn->recv_msg = malloc(sizeof(struct message));
-    conn->rdma_local_region = malloc(RDMA_BUFFER_SIZE);
     bzero(conn->recv_msg, sizeof(struct message));
-    bzero(conn->rdma_local_region, RDMA_BUFFER_SIZE);
     TEST_Z(conn->recv_mr = ibv_reg_mr(s_ctx->pd, conn->recv_msg, sizeof(struct message), IBV_ACCESS_LOCAL_WRITE));
-    TEST_Z(conn->rdma_local_mr = ibv_reg_mr(s_ctx->pd, conn->rdma_local_region, RDMA_BUFFER_SIZE, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ));
 	
     conn->send_msg = malloc(sizeof(struct message));
     bzero(conn->send_msg, sizeof(struct message));
     TEST_Z(conn->send_mr = ibv_reg_mr(s_ctx->pd, conn->send_msg, sizeof(struct message), IBV_ACCESS_LOCAL_WRITE));
 }
 
-void build_qp_attr_client(struct ibv_qp_init_attr *qp_attr)
+void build_qp_attr_client(struct ibv_qp_init_attr *qp_attr, struct ibv_cq *cq)
 {
     memset(qp_attr, 0, sizeof(*qp_attr));
-    qp_attr->send_cq = s_ctx->cq;
-    qp_attr->recv_cq = s_ctx->cq;
+    qp_attr->send_cq = cq;
+    qp_attr->recv_cq = cq;
     qp_attr->qp_type = IBV_QPT_RC;
-    qp_attr->cap.max_send_wr = 10;
+    qp_attr->cap.max_send_wr = RDMA_QUEUE_DEPTH + 1;
     qp_attr->cap.max_recv_wr = 10;
     qp_attr->cap.max_send_sge = 1;
     qp_attr->cap.max_recv_sge = 1;
+    qp_attr->cap.max_inline_data = sizeof(struct message);
 }
 
 void build_params_client(struct rdma_conn_param *params)
 {
+    int rd_atom = RDMA_QUEUE_DEPTH;
+
     memset(params, 0, sizeof(*params));
 
-    params->initiator_depth = params->responder_resources = 1;
+    /* let the responder keep as many of our reads in flight as it can */
+    if (rd_atom > s_ctx->dev_attr.max_qp_init_rd_atom)
+        rd_atom = s_ctx->dev_attr.max_qp_init_rd_atom;
+    params->initiator_depth = rd_atom;
+    params->responder_resources = 1;
     params->rnr_retry_count = 7;
 }
 
@@ -152,12 +269,88 @@ void build_context_client(struct ibv_context *verbs)
 
     s_ctx = (struct context *)malloc(sizeof(struct context));
     s_ctx->ctx = verbs;
+    region_place(s_ctx->ctx);
+    region_report_placement();
+
+    TEST_NZ(ibv_query_device(s_ctx->ctx, &s_ctx->dev_attr));
+    if (RDMA_QUEUE_DEPTH >= s_ctx->dev_attr.max_qp_wr)
+    {
+        RDMA_QUEUE_DEPTH = s_ctx->dev_attr.max_qp_wr - 1;
+        printf("queue depth limited to %d by device\n", RDMA_QUEUE_DEPTH);
+    }
+    if (RDMA_POST_BATCH > RDMA_QUEUE_DEPTH)
+        RDMA_POST_BATCH = RDMA_QUEUE_DEPTH;
+    /* unsignaled reads only give their slots back with a later CQE, so one must fit in the queue */
+    if (RDMA_SIGNAL_INTERVAL > RDMA_QUEUE_DEPTH)
+        RDMA_SIGNAL_INTERVAL = RDMA_QUEUE_DEPTH;
 
     TEST_Z(s_ctx->pd = ibv_alloc_pd(s_ctx->ctx));
-    TEST_Z(s_ctx->comp_channel = ibv_create_comp_channel(s_ctx->ctx));
-    TEST_Z(s_ctx->cq = ibv_create_cq(s_ctx->ctx, 10, NULL, s_ctx->comp_channel, 0));
-    TEST_NZ(ibv_req_notify_cq(s_ctx->cq, 0));
-    TEST_NZ(pthread_create(&s_ctx->cq_poller_thread, NULL, poll_cq, NULL));
+
+    TEST_Z(s_ctx->rdma_local_region = region_alloc(&s_ctx->local_region, RDMA_BUFFER_SIZE));
+    /* the reads overwrite it anyway; under odp only the pages they land on should become resident */
+    if (REGION_REG_MODE == REGION_REG_PINNED)
+        region_fill(&s_ctx->local_region, RDMA_BUFFER_SIZE, "", 1);
+    TEST_Z(s_ctx->rdma_local_mr = region_reg_mr(&s_ctx->local_region, s_ctx->pd, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ));
+    region_report("local region", &s_ctx->local_region);
+
+    TEST_Z(s_ctx->conns = calloc(RDMA_NUM_QPS, sizeof(struct connection_client *)));
+    s_ctx->num_conns = 0;
+    s_ctx->started_conns = 0;
+    s_ctx->finished_conns = 0;
+    s_ctx->disconnected_conns = 0;
+    TEST_NZ(pthread_mutex_init(&s_ctx->lock, NULL));
+
+    int qps_per_cq = (RDMA_NUM_QPS + RDMA_NUM_CQS - 1) / RDMA_NUM_CQS;
+
+    TEST_Z(s_ctx->cqs = calloc(RDMA_NUM_CQS, sizeof(struct ibv_cq *)));
+    TEST_Z(s_ctx->comp_channels = calloc(RDMA_NUM_CQS, sizeof(struct ibv_comp_channel *)));
+    TEST_Z(s_ctx->cq_poller_threads = calloc(RDMA_NUM_CQS, sizeof(pthread_t)));
+    TEST_Z(cq_batch_hist = calloc(RDMA_NUM_CQS, sizeof(*cq_batch_hist)));
+    for (int i = 0; i < RDMA_NUM_CQS; i++)
+    {
+        TEST_Z(s_ctx->comp_channels[i] = ibv_create_comp_channel(s_ctx->ctx));
+        TEST_Z(s_ctx->cqs[i] = ibv_create_cq(s_ctx->ctx, qps_per_cq * (RDMA_QUEUE_DEPTH + 10), NULL, s_ctx->comp_channels[i], 0));
+        TEST_NZ(pthread_create(&s_ctx->cq_poller_threads[i], NULL, poll_cq, (void *)(uintptr_t)i));
+
+        if (RDMA_NUM_CPUS)
+        {
+            cpu_set_t cpus;
+            int cpu = RDMA_CPUS[i % RDMA_NUM_CPUS];
+
+            CPU_ZERO(&cpus);
+            CPU_SET(cpu, &cpus);
+            TEST_NZ(pthread_setaffinity_np(s_ctx->cq_poller_threads[i], sizeof(cpus), &cpus));
+            printf("cq %d poller pinned to cpu %d\n", i, cpu);
+        }
+        else if (region_pin_thread(s_ctx->cq_poller_threads[i]) == 0)
+            printf("cq %d poller pinned to the placement node\n", i);
+    }
+}
+
+/* pick this QP's share of the region's blocks */
+void stripe_blocks(struct connection_client *conn)
+{
+    unsigned long total = (RDMA_BUFFER_SIZE + RDMA_BLOCK_SIZE - 1) / RDMA_BLOCK_SIZE;
+    unsigned long last;
+
+    if (RDMA_STRIPE == STRIPE_SHARD)
+    {
+        conn->first_block = total * conn->index / RDMA_NUM_QPS;
+        conn->block_stride = 1;
+        conn->num_blocks = total * (conn->index + 1) / RDMA_NUM_QPS - conn->first_block;
+    }
+    else
+    {
+        conn->first_block = conn->index;
+        conn->block_stride = RDMA_NUM_QPS;
+        conn->num_blocks = (total - conn->index + RDMA_NUM_QPS - 1) / RDMA_NUM_QPS;
+    }
+
+    /* the last block of the region may be short */
+    last = conn->first_block + (conn->num_blocks - 1) * conn->block_stride;
+    conn->bytes = conn->num_blocks * RDMA_BLOCK_SIZE;
+    if (last == total - 1)
+        conn->bytes -= total * RDMA_BLOCK_SIZE - RDMA_BUFFER_SIZE;
 }
 
 void build_connection_client(struct rdma_cm_id *id)
@@ -166,12 +359,27 @@ void build_connection_client(struct rdma_cm_id *id)
     struct ibv_qp_init_attr qp_attr;
 
     build_context_client(id->verbs);
-    build_qp_attr_client(&qp_attr);
-    TEST_NZ(rdma_create_qp(id, s_ctx->pd, &qp_attr));
     id->context = conn = (struct connection_client *)malloc(sizeof(struct connection_client));
+    conn->index = s_ctx->num_conns++;
+    s_ctx->conns[conn->index] = conn;
+    conn->cq = s_ctx->cqs[conn->index % RDMA_NUM_CQS];
+
+    build_qp_attr_client(&qp_attr, conn->cq);
+    TEST_NZ(rdma_create_qp(id, s_ctx->pd, &qp_attr));
     conn->id = id;
     conn->qp = id->qp;
-    conn->connected = 0;
+    conn->state = CONN_CONNECTING;
+    TEST_NZ(pthread_mutex_init(&conn->state_lock, NULL));
+    TEST_Z(conn->pending_sends = calloc(MAX_PENDING_SENDS, sizeof(struct message)));
+    conn->num_pending_sends = 0;
+    conn->setup_cpu_us = 0;
+    stripe_blocks(conn);
+    conn->posted_blocks = 0;
+    conn->completed_blocks = 0;
+    conn->cqes = 0;
+    TEST_NZ(pthread_mutex_init(&conn->fill_lock, NULL));
+    TEST_Z(conn->read_wr = calloc(RDMA_POST_BATCH, sizeof(struct ibv_send_wr)));
+    TEST_Z(conn->read_sge = calloc(RDMA_POST_BATCH, sizeof(struct ibv_sge)));
     register_memory_client(conn);
     post_receives(conn);
 }
@@ -212,25 +420,119 @@ int main(int argc, char **argv)
     struct rdma_cm_event *event = NULL;
     struct rdma_cm_id *conn = NULL;
     struct rdma_event_channel *ec = NULL;
+    int op;
+    int threads = 0, qp_opts = 0;
+
+    launch = get_cycles();
 
-    if (argc != 5)
+    while ((op = getopt(argc, argv, "d:b:s:c:P:u:q:C:S:t:a:H:O:N:F:")) != -1)
+    {
+        switch (op)
+        {
+        case 'd':
+            TEST_Z(RDMA_QUEUE_DEPTH = atoi(optarg));
+            break;
+        case 'b':
+            TEST_Z(RDMA_POST_BATCH = atoi(optarg));
+            break;
+        case 's':
+            TEST_Z(RDMA_SIGNAL_INTERVAL = atoi(optarg));
+            break;
+        case 'c':
+            TEST_Z(CQ_POLL_BATCH = atoi(optarg));
+            break;
+        case 'P':
+            if (set_poll_mode(optarg))
+                usage(argv[0]);
+            break;
+        case 'u':
+            CQ_SPIN_US = atoi(optarg);
+            break;
+        case 'q':
+            TEST_Z(RDMA_NUM_QPS = atoi(optarg));
+            qp_opts = 1;
+            break;
+        case 'C':
+            TEST_Z(RDMA_NUM_CQS = atoi(optarg));
+            qp_opts = 1;
+            break;
+        case 'S':
+            qp_opts = 1;
+            if (strcmp(optarg, stripe_names[STRIPE_RR]) == 0)
+                RDMA_STRIPE = STRIPE_RR;
+            else if (strcmp(optarg, stripe_names[STRIPE_SHARD]) == 0)
+                RDMA_STRIPE = STRIPE_SHARD;
+            else
+                usage(argv[0]);
+            break;
+        case 't':
+            TEST_Z(threads = atoi(optarg));
+            break;
+        case 'a':
+            if (parse_cpu_list(optarg))
+                usage(argv[0]);
+            break;
+        case 'H':
+            if (region_set_backend(optarg))
+                usage(argv[0]);
+            break;
+        case 'O':
+            if (region_set_reg_mode(optarg))
+                usage(argv[0]);
+            break;
+        case 'N':
+            if (region_set_numa(optarg))
+                usage(argv[0]);
+            break;
+        case 'F':
+            REGION_FILL_THREADS = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    /* -t picks qps, cqs and striping itself, so it does not mix with -q, -C or -S */
+    if (argc - optind != 4 || (threads && qp_opts))
         usage(argv[0]);
+    argv += optind - 1;
+
+    if (threads)
+    {
+        /* one worker per thread: its own QP, CQ, poller and contiguous slice */
+        RDMA_NUM_QPS = RDMA_NUM_CQS = threads;
+        RDMA_STRIPE = STRIPE_SHARD;
+    }
 
     TEST_Z(RDMA_BLOCK_SIZE = atoi(argv[4]));
+    if (RDMA_NUM_QPS > (RDMA_BUFFER_SIZE + RDMA_BLOCK_SIZE - 1) / RDMA_BLOCK_SIZE)
+        RDMA_NUM_QPS = (RDMA_BUFFER_SIZE + RDMA_BLOCK_SIZE - 1) / RDMA_BLOCK_SIZE;
+    if (RDMA_NUM_CQS > RDMA_NUM_QPS)
+        RDMA_NUM_CQS = RDMA_NUM_QPS;
 
     TEST_NZ(getaddrinfo(argv[2], argv[3], NULL, &addr));
 
     TEST_Z(ec = rdma_create_event_channel());
-    TEST_NZ(rdma_create_id(ec, &conn, NULL, RDMA_PS_TCP));
-    TEST_NZ(rdma_resolve_addr(conn, NULL, addr->ai_addr, TIMEOUT_IN_MS));
+    for (int i = 0; i < RDMA_NUM_QPS; i++)
+    {
+        TEST_NZ(rdma_create_id(ec, &conn, NULL, RDMA_PS_TCP));
+        TEST_NZ(rdma_resolve_addr(conn, NULL, addr->ai_addr, TIMEOUT_IN_MS));
+    }
 
     freeaddrinfo(addr);
 
     while (rdma_get_cm_event(ec, &event) == 0)
     {
         struct rdma_cm_event event_copy;
+        uint8_t private_data[UINT8_MAX];
 
         memcpy(&event_copy, event, sizeof(*event));
+        /* the private data goes away with the event once it is acked */
+        if (event->event == RDMA_CM_EVENT_ESTABLISHED && event->param.conn.private_data_len)
+        {
+            memcpy(private_data, event->param.conn.private_data, event->param.conn.private_data_len);
+            event_copy.param.conn.private_data = private_data;
+        }
         rdma_ack_cm_event(event);
 
         if (on_event(&event_copy))
@@ -251,7 +553,14 @@ int on_addr_resolved(struct rdma_cm_id *id)
 
 void on_connect_client(void *context)
 {
-    ((struct connection_client *)context)->connected = 1;
+    struct connection_client *conn = (struct connection_client *)context;
+
+    pthread_mutex_lock(&conn->state_lock);
+    conn->state = CONN_ESTABLISHED;
+    for (int i = 0; i < conn->num_pending_sends; i++)
+        post_message(conn, &conn->pending_sends[i]);
+    conn->num_pending_sends = 0;
+    pthread_mutex_unlock(&conn->state_lock);
 }
 
 int on_connection(struct rdma_cm_id *id)
@@ -273,13 +582,16 @@ void destroy_connection_client(void *context)
 
     rdma_destroy_qp(conn->id);
     ibv_dereg_mr(conn->recv_mr);
-    ibv_dereg_mr(conn->rdma_local_mr);
 
     free(conn->recv_msg);
-    free(conn->rdma_local_region);
+    free(conn->read_wr);
+    free(conn->read_sge);
+    pthread_mutex_destroy(&conn->fill_lock);
 
     rdma_destroy_id(conn->id);
 
+    free(conn->pending_sends);
+    pthread_mutex_destroy(&conn->state_lock);
     free(conn);
 }
 
@@ -287,12 +599,21 @@ int on_disconnect_client(struct rdma_cm_id *id)
 {
     printf("peer disconnected.\n");
     destroy_connection_client(id->context);
+
+    /* leave the event loop once every QP is gone */
+    if (++s_ctx->disconnected_conns < s_ctx->num_conns)
+        return 0;
+
+    region_dereg_mr(&s_ctx->local_region, s_ctx->rdma_local_mr);
+    region_free(&s_ctx->local_region);
     return 1;
 }
 
 int on_event(struct rdma_cm_event *event)
 {
     int r = 0;
+    double cpu = thread_cpu_us();
+
     switch (event->event)
     {
     case RDMA_CM_EVENT_ADDR_RESOLVED:
@@ -302,7 +623,7 @@ int on_event(struct rdma_cm_event *event)
         r = on_route_resolved(event->id);
         break;
     case RDMA_CM_EVENT_ESTABLISHED:
-        r = on_connection_client(event->id);
+        r = on_connection_client(event->id, &event->param.conn);
         break;
     case RDMA_CM_EVENT_DISCONNECTED:
         r = on_disconnect_client(event->id);
@@ -311,6 +632,16 @@ int on_event(struct rdma_cm_event *event)
         die("on_event: unknown event.");
         break;
     }
+
+    /* what the cm thread spends on a connection until it is established is its setup cost */
+    if (event->event == RDMA_CM_EVENT_ADDR_RESOLVED || event->event == RDMA_CM_EVENT_ROUTE_RESOLVED || event->event == RDMA_CM_EVENT_ESTABLISHED)
+    {
+        struct connection_client *conn = (struct connection_client *)event->id->context;
+
+        conn->setup_cpu_us += thread_cpu_us() - cpu;
+        if (event->event == RDMA_CM_EVENT_ESTABLISHED)
+            printf("connection set up with %lf us of cpu.\n", conn->setup_cpu_us);
+    }
     return r;
 }
 
@@ -319,18 +650,55 @@ int on_route_resolved(struct rdma_cm_id *id)
     struct rdma_conn_param cm_params;
 
     build_params_client(&cm_params);
+    if (!connect_start)
+        connect_start = get_cycles();
     TEST_NZ(rdma_connect(id, &cm_params));
 
     return 0;
 }
 
+/* "0,2,4-7" -> RDMA_CPUS */
+int parse_cpu_list(const char *list)
+{
+    char *copy, *tok, *save = NULL;
+
+    TEST_Z(copy = strdup(list));
+    for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+    {
+        int lo, hi;
+
+        if (sscanf(tok, "%d-%d", &lo, &hi) != 2)
+        {
+            if (sscanf(tok, "%d", &lo) != 1)
+            {
+                free(copy);
+                return -1;
+            }
+            hi = lo;
+        }
+        if (lo < 0 || hi < lo)
+        {
+            free(copy);
+            return -1;
+        }
+        for (int cpu = lo; cpu <= hi; cpu++)
+        {
+            TEST_Z(RDMA_CPUS = realloc(RDMA_CPUS, (RDMA_NUM_CPUS + 1) * sizeof(int)));
+            RDMA_CPUS[RDMA_NUM_CPUS++] = cpu;
+        }
+    }
+    free(copy);
+    return RDMA_NUM_CPUS ? 0 : -1;
+}
+
 void usage(const char *argv0)
 {
-    fprintf(stderr, "usage: %s <mode> <server-address> <server-port> <block-size>\n  mode = \"read\", \"write\"\n", argv0);
+    fprintf(stderr, "usage: %s [-d queue-depth] [-b post-batch] [-s signal-interval] [-c cq-poll-batch] [-P poll-mode] [-u spin-us] [-q qps] [-C cqs] [-S stripe] [-t threads] [-a cpu-list] [-H pages] [-O reg] [-N numa-node] [-F fill-threads] <mode> <server-address> <server-port> <block-size>\n  mode = \"read\", \"write\"\n  poll-mode = \"event\", \"busy\", \"hybrid\"\n  stripe = \"rr\", \"shard\"\n  threads = one qp, cq and poller each, sharded; not with -q, -C or -S\n  cpu-list = e.g. \"0,2,4-7\"\n  pages = \"malloc\", \"2m\", \"1g\" or a hugetlbfs mount\n  reg = \"pinned\", \"odp\", \"implicit\"\n  numa-node = node number or \"off\", default is the node of the device\n  fill-threads = threads that first touch the buffers, default one per cpu of the node\n", argv0);
     exit(1);
 }
 
-void send_message(struct connection_client *conn)
+/* control messages go inline, so msg does not have to be registered */
+void post_message(struct connection_client *conn, struct message *msg)
 {
     struct ibv_send_wr wr, *bad_wr = NULL;
     struct ibv_sge sge;
@@ -340,44 +708,118 @@ void send_message(struct connection_client *conn)
     wr.opcode = IBV_WR_SEND;
     wr.sg_list = &sge;
     wr.num_sge = 1;
-    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.send_flags = IBV_SEND_SIGNALED | IBV_SEND_INLINE;
 
-    sge.addr = (uintptr_t)conn->send_msg;
+    sge.addr = (uintptr_t)msg;
     sge.length = sizeof(struct message);
     sge.lkey = conn->send_mr->lkey;
 
-    while(!conn->connected);
-
     TEST_NZ(ibv_post_send(conn->qp, &wr, &bad_wr));
 }
 
+void send_message(struct connection_client *conn)
+{
+    pthread_mutex_lock(&conn->state_lock);
+    if (conn->state == CONN_ESTABLISHED)
+        post_message(conn, conn->send_msg);
+    else if (conn->num_pending_sends < MAX_PENDING_SENDS)
+        conn->pending_sends[conn->num_pending_sends++] = *conn->send_msg;
+    else
+        die("send_message: too many sends before the connection was established.");
+    pthread_mutex_unlock(&conn->state_lock);
+}
+
 void send_read_finish(struct connection_client *conn)
 {
-    memset(conn->send_msg, 0, sizeof(struct message));
+    conn->send_msg->version = MSG_VERSION;
     conn->send_msg->type = MSG_DONE;
+    conn->send_msg->seq++;
     send_message(conn);
 }
 
 
-void post_rdma_read_client(struct connection_client *conn)
+/*
+ * post the next n block reads as one chain, ringing the doorbell once;
+ * only every RDMA_SIGNAL_INTERVAL-th read and the last one ask for a CQE
+ */
+void post_rdma_read_client(struct connection_client *conn, int n)
 {
-    struct ibv_send_wr wr, *bad_wr = NULL;
-    struct ibv_sge sge;
+    struct ibv_send_wr *wr, *bad_wr = NULL;
+    struct ibv_sge *sge;
 
-    memset(&wr, 0, sizeof(wr));
-    wr.wr_id = (uintptr_t)conn;
-    wr.opcode = IBV_WR_RDMA_READ;
-    wr.sg_list = &sge;
-    wr.num_sge = 1;
-    wr.send_flags = IBV_SEND_SIGNALED;
-    wr.wr.rdma.remote_addr = (uintptr_t)conn->server_mr.addr;
-    wr.wr.rdma.rkey = conn->server_mr.rkey;
+    for (int i = 0; i < n; i++)
+    {
+        unsigned long k = conn->posted_blocks + i;
+        unsigned long off = (conn->first_block + k * conn->block_stride) * RDMA_BLOCK_SIZE;
+
+        wr = &conn->read_wr[i];
+        sge = &conn->read_sge[i];
+
+        memset(wr, 0, sizeof(*wr));
+        wr->wr_id = (uintptr_t)conn;
+        wr->opcode = IBV_WR_RDMA_READ;
+        wr->sg_list = sge;
+        wr->num_sge = 1;
+        if ((k + 1) % RDMA_SIGNAL_INTERVAL == 0 || k + 1 == conn->num_blocks)
+            wr->send_flags = IBV_SEND_SIGNALED;
+        wr->wr.rdma.remote_addr = (uintptr_t)conn->server_mr.addr + off;
+        wr->wr.rdma.rkey = conn->server_mr.rkey;
+        wr->next = (i + 1 < n) ? &conn->read_wr[i + 1] : NULL;
+
+        sge->addr = (uintptr_t)(s_ctx->rdma_local_region + off);
+        sge->length = (RDMA_BUFFER_SIZE - off < RDMA_BLOCK_SIZE) ? RDMA_BUFFER_SIZE - off : RDMA_BLOCK_SIZE;
+        sge->lkey = s_ctx->rdma_local_mr->lkey;
+    }
+
+    TEST_NZ(ibv_post_send(conn->qp, conn->read_wr, &bad_wr));
+    conn->posted_blocks += n;
+}
 
-    sge.addr = (uintptr_t)conn->rdma_local_region;
-    sge.length = RDMA_BUFFER_SIZE;
-    sge.lkey = conn->rdma_local_mr->lkey;
+/*
+ * keep up to RDMA_QUEUE_DEPTH block reads outstanding, posting them in
+ * chains of RDMA_POST_BATCH; only the tail of the region goes out short
+ */
+void fill_read_pipeline(struct connection_client *conn)
+{
+    while (conn->posted_blocks < conn->num_blocks)
+    {
+        unsigned long free_slots = RDMA_QUEUE_DEPTH - (conn->posted_blocks - conn->completed_blocks);
+        unsigned long remaining = conn->num_blocks - conn->posted_blocks;
+        unsigned long n = (remaining < RDMA_POST_BATCH) ? remaining : RDMA_POST_BATCH;
 
-    TEST_NZ(ibv_post_send(conn->qp, &wr, &bad_wr));
+        if (free_slots < n)
+        {
+            /* a signaled read is still in flight: wait for it to hand back slots */
+            if (conn->posted_blocks - conn->completed_blocks >= RDMA_SIGNAL_INTERVAL)
+                break;
+            n = free_slots;
+        }
+        post_rdma_read_client(conn, n);
+    }
+}
+
+void set_server_mr(struct connection_client *conn, const struct message *msg)
+{
+    conn->server_mr.addr = (void *)(uintptr_t)msg->addr;
+    conn->server_mr.rkey = msg->rkey;
+    conn->server_mr.length = msg->length;
+}
+
+void start_reads(struct connection_client *conn)
+{
+    /* the run starts with the first QP to get going */
+    pthread_mutex_lock(&s_ctx->lock);
+    if (s_ctx->started_conns++ == 0)
+    {
+        cpu_start = cpu_seconds();
+        start = get_cycles();
+    }
+    pthread_mutex_unlock(&s_ctx->lock);
+
+    conn->start = get_cycles();
+    pthread_mutex_lock(&conn->fill_lock);
+    fill_read_pipeline(conn);
+    pthread_mutex_unlock(&conn->fill_lock);
 }
 
 void on_completion_client(struct ibv_wc *wc)
@@ -389,50 +831,203 @@ void on_completion_client(struct ibv_wc *wc)
 
     if (wc->opcode & IBV_WC_RECV)
     {
+        if (conn->recv_msg->version != MSG_VERSION)
+            die("on_completion: unknown message version.");
+
         printf("recv success\n");
         
         if (conn->recv_msg->type == MSG_MR)
+            set_server_mr(conn, conn->recv_msg);
+        start_reads(conn);
+    }
+    else if (wc->opcode == IBV_WC_RDMA_READ)
+    {
+        if (!first_byte)
+        {
+            pthread_mutex_lock(&s_ctx->lock);
+            if (!first_byte)
+                first_byte = get_cycles();
+            pthread_mutex_unlock(&s_ctx->lock);
+        }
+
+        /* reads complete in order, so this CQE also retires the unsignaled ones before it */
+        conn->cqes++;
+        conn->completed_blocks += RDMA_SIGNAL_INTERVAL;
+        if (conn->completed_blocks > conn->num_blocks)
+            conn->completed_blocks = conn->num_blocks;
+        if (conn->completed_blocks < conn->num_blocks)
         {
-            memcpy(&conn->server_mr, &conn->recv_msg->data.mr, sizeof(conn->server_mr));
+            pthread_mutex_lock(&conn->fill_lock);
+            fill_read_pipeline(conn);
+            pthread_mutex_unlock(&conn->fill_lock);
         }
-        start = get_cycles();   
-        post_rdma_read_client(conn);
+        else
+            on_read_finish(conn);
     }
-    else
+}
+
+/* the last QP to finish reports for the whole run and tears every QP down */
+void on_read_finish(struct connection_client *conn)
+{
+    conn->end = get_cycles();
+
+    pthread_mutex_lock(&s_ctx->lock);
+    if (++s_ctx->finished_conns < RDMA_NUM_QPS)
+    {
+        pthread_mutex_unlock(&s_ctx->lock);
+        return;
+    }
+    pthread_mutex_unlock(&s_ctx->lock);
+
+    unsigned long num_blocks = 0, cqes = 0;
+
+    end = get_cycles();
+    cycles_to_units = get_cpu_mhz(0) * 1000000;
+    sum_of_test_cycles = (double)(end - start);
+
+    for (int i = 0; i < RDMA_NUM_QPS; i++)
+    {
+        struct connection_client *c = s_ctx->conns[i];
+        double qp_time = (double)(c->end - c->start) / cycles_to_units;
+
+        num_blocks += c->num_blocks;
+        cqes += c->cqes;
+        printf("qp %d (cq %d) : blocks : %lu, bytes : %lu, time : %lf s, throughput : %lf MB/s\n", i, i % RDMA_NUM_CQS, c->num_blocks, c->bytes, qp_time, c->bytes / (qp_time * 0x100000));
+    }
+
+    FILE *fp;
+    TEST_Z(fp = fopen("./data-cas-sequential", "a"));
+
+    double tp_avg = ((double) RDMA_BUFFER_SIZE * cycles_to_units) / (sum_of_test_cycles * 0x100000);
+    double iops = ((double) num_blocks * cycles_to_units) / (sum_of_test_cycles * 1000);
+    double cqe_per_byte = (double) cqes / RDMA_BUFFER_SIZE;
+    double wall_time = sum_of_test_cycles / cycles_to_units;
+    double cpu_usage = (cpu_seconds() - cpu_start) * 100 / wall_time;
+    /* Little's law: with RDMA_QUEUE_DEPTH reads in flight per QP each one takes depth * qps / iops */
+    double latency = wall_time * 1000000 * RDMA_QUEUE_DEPTH * RDMA_NUM_QPS / num_blocks;
+    /* from process launch, so it includes allocating and registering the landing region */
+    double ttfb = (first_byte - launch) * 1000000 / cycles_to_units;
+    long rss = region_rss_kb();
+    printf("qps : %d, cqs : %d, stripe : %s\n", RDMA_NUM_QPS, RDMA_NUM_CQS, stripe_names[RDMA_STRIPE]);
+    printf("blocks : %lu, queue depth : %d, post batch : %d, signal interval : %d\n", num_blocks, RDMA_QUEUE_DEPTH, RDMA_POST_BATCH, RDMA_SIGNAL_INTERVAL);
+    printf("throughput : %lf MB/s, iops : %lf K/s, cqes : %lu, cqe per byte : %e\n", tp_avg, iops, cqes, cqe_per_byte);
+    printf("poll mode : %s, avg block latency : %lf us, cpu usage : %lf %%\n", poll_mode_names[CQ_POLL_MODE], latency, cpu_usage);
+    printf("registration : %s, time to first byte : %lf us, rss : %ld KB\n", region_reg_names[s_ctx->local_region.reg], ttfb, rss);
+    printf("startup : %lf s before the first read was posted\n", (start - launch) / cycles_to_units);
+    printf("connect to first byte : %lf us\n", (first_byte - connect_start) * 1000000 / cycles_to_units);
+    //double bw_avg = ((double) RDMA_BUFFER_SIZE * cycles_to_units) / (sum_of_test_cycles * 0x100000);
+    //printf("\nsum_of_test_cycles : %lf\n", sum_of_test_cycles);
+    //printf("\ncpu time : %lf s, cpu frequency : %lf hz\n bandwidth : %lf MB/s, throughput : %lf MB/s\n", sum_of_test_cycles/cycles_to_units, cycles_to_units, bw_avg, tp_avg);
+    fprintf(fp, "%lu cputime(s) %lf throughput(MB/s) %lf iops(K/s) %lf cqe/byte %e latency(us) %lf cpu(%%) %lf ttfb(us) %lf rss(KB) %ld threads %d\n", RDMA_BLOCK_SIZE, sum_of_test_cycles/cycles_to_units, tp_avg, iops, cqe_per_byte, latency, cpu_usage, ttfb, rss, RDMA_NUM_CQS);
+    fclose(fp);
+    print_cq_batch_hist();
+
+    for (int i = 0; i < RDMA_NUM_QPS; i++)
+        rdma_disconnect(s_ctx->conns[i]->id);
+}
+
+/*
+ * bucket i counts polls that drained [2^i, 2^(i+1)) completions at once;
+ * every cq has its own row so pollers never share a counter
+ */
+void record_cq_batch(int cq, int n)
+{
+    int i = 0;
+
+    while (n >>= 1)
+        i++;
+    if (i >= CQ_BATCH_HIST_SIZE)
+        i = CQ_BATCH_HIST_SIZE - 1;
+    cq_batch_hist[cq][i]++;
+}
+
+void print_cq_batch_hist(void)
+{
+    printf("cq poll batch histogram (batch %d):\n", CQ_POLL_BATCH);
+    for (int i = 0; i < CQ_BATCH_HIST_SIZE; i++)
+    {
+        unsigned long count = 0;
+
+        for (int cq = 0; cq < RDMA_NUM_CQS; cq++)
+            count += cq_batch_hist[cq][i];
+        if (count)
+            printf("  %5d - %5d : %lu\n", 1 << i, (1 << (i + 1)) - 1, count);
+    }
+}
+
+int set_poll_mode(const char *name)
+{
+    for (int i = 0; i < sizeof(poll_mode_names) / sizeof(poll_mode_names[0]); i++)
     {
-        for(int i = 0; i < RDMA_BUFFER_SIZE; i = i + RDMA_BLOCK_SIZE) {
-            point = conn->rdma_local_region + i;
+        if (strcmp(name, poll_mode_names[i]) == 0)
+        {
+            CQ_POLL_MODE = i;
+            return 0;
         }
-        
-        FILE *fp;
-        TEST_Z(fp = fopen("./data-cas-sequential", "a"));
-
-        end = get_cycles();
-        cycles_to_units = get_cpu_mhz(0) * 1000000;
-        sum_of_test_cycles = (double)(end - start);
-        double tp_avg = ((double) RDMA_BUFFER_SIZE * cycles_to_units) / (sum_of_test_cycles * 0x100000);
-        //double bw_avg = ((double) RDMA_BUFFER_SIZE * cycles_to_units) / (sum_of_test_cycles * 0x100000);
-        //printf("\nsum_of_test_cycles : %lf\n", sum_of_test_cycles);
-        //printf("\ncpu time : %lf s, cpu frequency : %lf hz\n bandwidth : %lf MB/s, throughput : %lf MB/s\n", sum_of_test_cycles/cycles_to_units, cycles_to_units, bw_avg, tp_avg);
-        fprintf(fp, "%lu cputime(s) %lf throughput(MB/s) %lf\n", RDMA_BLOCK_SIZE, sum_of_test_cycles/cycles_to_units, tp_avg);
-        fclose(fp);
-        rdma_disconnect(conn->id);
     }
+    return -1;
+}
+
+/* user + system time of the whole process, so it covers the poller thread too */
+double cpu_seconds(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
 }
 
+/*
+ * POLL_EVENT  : sleep on the completion channel whenever the cq is empty
+ * POLL_BUSY   : never arm the cq, spin on ibv_poll_cq
+ * POLL_HYBRID : spin for CQ_SPIN_US after the last completion, then arm and sleep
+ */
 void *poll_cq(void *context)
 {
-    struct ibv_cq *cq;
-    struct ibv_wc wc;
+    int index = (uintptr_t)context;
+    struct ibv_cq *cq = s_ctx->cqs[index];
+    struct ibv_wc *wc;
+    cycles_t idle_start = get_cycles();
+    cycles_t spin_cycles = 0;
+    int armed = 0;
+    int n;
+
+    TEST_Z(wc = calloc(CQ_POLL_BATCH, sizeof(struct ibv_wc)));
+    if (CQ_POLL_MODE == POLL_HYBRID)
+        spin_cycles = get_cpu_mhz(0) * CQ_SPIN_US;
 
     while (1)
     {
-        TEST_NZ(ibv_get_cq_event(s_ctx->comp_channel, &cq, &context));
-        ibv_ack_cq_events(cq, 1);
-        TEST_NZ(ibv_req_notify_cq(cq, 0));
+        if ((n = ibv_poll_cq(cq, CQ_POLL_BATCH, wc)) < 0)
+            die("poll_cq: ibv_poll_cq failed.");
+
+        if (n > 0)
+        {
+            record_cq_batch(index, n);
+            for (int i = 0; i < n; i++)
+                on_completion_client(&wc[i]);
+            idle_start = get_cycles();
+            armed = 0;
+            continue;
+        }
+
+        if (CQ_POLL_MODE == POLL_BUSY)
+            continue;
+        if (CQ_POLL_MODE == POLL_HYBRID && get_cycles() - idle_start < spin_cycles)
+            continue;
+
+        /* arm, then poll once more so a completion racing the arm is not slept through */
+        if (!armed)
+        {
+            TEST_NZ(ibv_req_notify_cq(cq, 0));
+            armed = 1;
+            continue;
+        }
 
-        while (ibv_poll_cq(cq, 1, &wc))
-            on_completion_client(&wc);
+        TEST_NZ(ibv_get_cq_event(s_ctx->comp_channels[index], &cq, &context));
+        ibv_ack_cq_events(cq, 1);
+        idle_start = get_cycles();
+        armed = 0;
     }
 
     return NULL;
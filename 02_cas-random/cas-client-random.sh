@@ -1,6 +1,7 @@
 #!/bin/bash
 # Program:
 #       Record data about cpu time and throughput under cas-sequential-read mode automatically
+#       Extra arguments are passed to rdma-client, e.g. ./cas-client-random.sh -H 2m
 
 ip=192.168.0.13
 port=12345
@@ -14,7 +15,7 @@ do
     i=5
     while [ "$i" != "0" ]
     do
-        ./rdma-client read $ip $port $blocksize
+        ./rdma-client "$@" read $ip $port $blocksize
         i=$(($i-1))
     done
 done
@@ -0,0 +1,178 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "mr_cache.h"
+
+struct mr_cache_entry
+{
+    struct ibv_mr *mr;
+    struct ibv_pd *pd;
+    uintptr_t start, end;
+    int access;
+    int refcnt;
+    int stale;
+
+    /* lru order, most recently used first */
+    struct mr_cache_entry *prev, *next;
+};
+
+size_t MR_CACHE_BUDGET = 1UL << 30;
+
+static struct mr_cache_entry *head, *tail;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t pinned;
+static unsigned long hits, misses, evictions;
+
+static void unlink_entry(struct mr_cache_entry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void push_front(struct mr_cache_entry *e)
+{
+    e->prev = NULL;
+    e->next = head;
+    if (head)
+        head->prev = e;
+    else
+        tail = e;
+    head = e;
+}
+
+static void release(struct mr_cache_entry *e)
+{
+    pinned -= e->end - e->start;
+    ibv_dereg_mr(e->mr);
+    free(e);
+}
+
+static struct mr_cache_entry *find_mr(struct ibv_mr *mr)
+{
+    for (struct mr_cache_entry *e = head; e; e = e->next)
+    {
+        if (e->mr == mr)
+            return e;
+    }
+    return NULL;
+}
+
+struct ibv_mr *mr_cache_get(struct ibv_pd *pd, void *addr, size_t length, int access)
+{
+    uintptr_t start = (uintptr_t)addr, end = start + length;
+    struct mr_cache_entry *e, *next;
+    struct ibv_mr *mr;
+
+    pthread_mutex_lock(&lock);
+
+    for (e = head; e; e = e->next)
+    {
+        if (!e->stale && e->pd == pd && e->start <= start && end <= e->end && (e->access & access) == access)
+        {
+            e->refcnt++;
+            unlink_entry(e);
+            push_front(e);
+            hits++;
+            pthread_mutex_unlock(&lock);
+            return e->mr;
+        }
+    }
+    misses++;
+
+    /* fold idle registrations that overlap the range into the new one */
+    for (e = head; e; e = next)
+    {
+        next = e->next;
+        if (e->pd != pd || e->refcnt || e->end <= start || end <= e->start)
+            continue;
+        if (e->start < start)
+            start = e->start;
+        if (e->end > end)
+            end = e->end;
+        access |= e->access;
+        unlink_entry(e);
+        release(e);
+    }
+
+    for (e = tail; e && pinned + (end - start) > MR_CACHE_BUDGET; e = next)
+    {
+        next = e->prev;
+        if (e->refcnt)
+            continue;
+        unlink_entry(e);
+        release(e);
+        evictions++;
+    }
+
+    if (!(mr = ibv_reg_mr(pd, (void *)start, end - start, access)) || !(e = calloc(1, sizeof(*e))))
+    {
+        if (mr)
+            ibv_dereg_mr(mr);
+        pthread_mutex_unlock(&lock);
+        return NULL;
+    }
+    e->mr = mr;
+    e->pd = pd;
+    e->start = start;
+    e->end = end;
+    e->access = access;
+    e->refcnt = 1;
+    push_front(e);
+    pinned += end - start;
+
+    pthread_mutex_unlock(&lock);
+    return mr;
+}
+
+void mr_cache_put(struct ibv_mr *mr)
+{
+    struct mr_cache_entry *e;
+
+    pthread_mutex_lock(&lock);
+    if ((e = find_mr(mr)) && --e->refcnt == 0 && e->stale)
+    {
+        unlink_entry(e);
+        release(e);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/* drop every registration touching memory that is about to be freed */
+void mr_cache_invalidate(void *addr, size_t length)
+{
+    uintptr_t start = (uintptr_t)addr, end = start + length;
+    struct mr_cache_entry *e, *next;
+
+    pthread_mutex_lock(&lock);
+    for (e = head; e; e = next)
+    {
+        next = e->next;
+        if (e->end <= start || end <= e->start)
+            continue;
+        if (e->refcnt)
+        {
+            /* still in use: it can no longer be handed out, and goes with the last put */
+            e->stale = 1;
+            continue;
+        }
+        unlink_entry(e);
+        release(e);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void mr_cache_report(void)
+{
+    pthread_mutex_lock(&lock);
+    printf("mr cache : hits %lu, misses %lu, evictions %lu, pinned %lu / %lu KB\n",
+           hits, misses, evictions, (unsigned long)(pinned >> 10), (unsigned long)(MR_CACHE_BUDGET >> 10));
+    pthread_mutex_unlock(&lock);
+}
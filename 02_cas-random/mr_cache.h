@@ -0,0 +1,24 @@
+#ifndef MR_CACHE_H
+#define MR_CACHE_H
+
+#include <stddef.h>
+#include <infiniband/verbs.h>
+
+/*
+ * Process-wide cache of pinned registrations keyed by address range.
+ * mr_cache_get() hands out an existing mr that covers the range with at
+ * least the requested access, or registers a new one. mr_cache_put() only
+ * drops the reference; unreferenced mrs stay registered until they are
+ * evicted, least recently used first, to keep the pinned bytes under
+ * MR_CACHE_BUDGET. A hit may be a larger mr than asked for, so peers should
+ * be given the buffer address rather than mr->addr. Memory must be
+ * invalidated before it is freed.
+ */
+extern size_t MR_CACHE_BUDGET;
+
+struct ibv_mr *mr_cache_get(struct ibv_pd *pd, void *addr, size_t length, int access);
+void mr_cache_put(struct ibv_mr *mr);
+void mr_cache_invalidate(void *addr, size_t length);
+void mr_cache_report(void);
+
+#endif
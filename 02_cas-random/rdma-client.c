@@ -6,6 +6,8 @@
 #include <time.h>
 #include <rdma/rdma_cma.h>
 #include "get_clock.h"
+#include "permute.h"
+#include "region.h"
 
 #define TEST_NZ(x) do { if ( (x)) die("error: " #x " failed (returned non-zero)." ); } while (0)
 #define TEST_Z(x)  do { if (!(x)) die("error: " #x " failed (returned zero/null)."); } while (0)
@@ -14,22 +16,39 @@ const int TIMEOUT_IN_MS = 500;
 unsigned long RDMA_BUFFER_SIZE = 1024 * 1024 * 1024;
 unsigned long RDMA_BLOCK_SIZE;
 int offset = 0;
-char *point;
-unsigned long *rand_offset;
-int max_prime;
-
-cycles_t start, end;
+/* the order blocks are read in, drawn lazily from a seeded permutation */
+struct permute block_perm;
+uint64_t PERMUTE_SEED = 1;
+/* with -S, the buffer is read in pieces of this many blocks, each scattered to the blocks' permuted places */
+int SCATTER_SGE = 0;
+/* reads kept in flight */
+int QUEUE_DEPTH = 16;
+unsigned long read_next, reads_total, reads_done;
+/* the first window may be posted from the cm thread while the poller refills, so both take this */
+pthread_mutex_t read_lock = PTHREAD_MUTEX_INITIALIZER;
+
+cycles_t connect_start, first_byte, start, end;
 double cycles_to_units, sum_of_test_cycles;
 
 struct connection_client
 {
     struct rdma_cm_id *id;
     struct ibv_qp *qp;
-    int connected;
+    /* control sends made before ESTABLISHED wait in pending_sends until on_connect posts them */
+    enum
+    {
+        CONN_CONNECTING,
+        CONN_ESTABLISHED
+    } state;
+    pthread_mutex_t state_lock;
+    struct message *pending_sends;
+    int num_pending_sends;
+    double setup_cpu_us;
 
     struct ibv_mr *rdma_local_mr;
     struct message *recv_msg;
     struct ibv_mr *recv_mr;
+    struct region local_region;
     char *rdma_local_region;
 	
 	struct message *send_msg;
@@ -44,39 +63,62 @@ struct connection_client
     } recv_state;
 };
 
-struct message
+enum
 {
-    enum
-    {
-        MSG_MR,
-        MSG_DONE,
-    } type;
-
-    union {
-        struct ibv_mr mr;
-    } data;
+    MSG_MR,
+    MSG_DONE
 };
 
+#define MSG_VERSION 1
+#define MAX_PENDING_SENDS 4
+
+/* control message as it goes on the wire: fixed width, packed and small enough to send inline */
+struct message
+{
+    uint8_t version;
+    uint8_t type;
+    uint16_t reserved;
+    uint32_t rkey;
+    uint64_t addr;
+    uint32_t length;
+    uint32_t seq;
+    uint64_t index;
+} __attribute__((packed));
+
 struct context
 {
     struct ibv_context *ctx;
     struct ibv_pd *pd;
     struct ibv_cq *cq;
     struct ibv_comp_channel *comp_channel;
+    struct ibv_device_attr dev_attr;
     pthread_t cq_poller_thread;
 };
 
+#define CQ_BATCH_HIST_SIZE 16
+
+int CQ_POLL_BATCH = 16;
+unsigned long cq_batch_hist[CQ_BATCH_HIST_SIZE];
+
 static struct context *s_ctx = NULL;
 
 int on_addr_resolved(struct rdma_cm_id *id);
-int on_connection_client(struct rdma_cm_id *id);
+int on_connection_client(struct rdma_cm_id *id, const struct rdma_conn_param *param);
 int on_disconnect_client(struct rdma_cm_id *id);
 int on_event(struct rdma_cm_event *event);
+void post_message(struct connection_client *conn, struct message *msg);
 int on_route_resolved(struct rdma_cm_id *id);
 void usage(const char *argv0);
 void *poll_cq(void *context);
+void record_cq_batch(int n);
+void print_cq_batch_hist(void);
 void destroy_connection_client(void *context);
 void on_connect_client(void *context);
+void set_server_mr(struct connection_client *conn, const struct message *msg);
+void post_rdma_read_client(struct connection_client *conn);
+void start_reads(struct connection_client *conn);
+void post_scatter_read(struct connection_client *conn);
+unsigned long permuted_block(unsigned long b);
 
 void die(const char *reason)
 {
@@ -84,6 +126,14 @@ void die(const char *reason)
     exit(EXIT_FAILURE);
 }
 
+double thread_cpu_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
 void post_receives(struct connection_client *conn)
 {
     struct ibv_recv_wr wr, *bad_wr = NULL;
@@ -101,20 +151,33 @@ void post_receives(struct connection_client *conn)
     TEST_NZ(ibv_post_recv(conn->qp, &wr, &bad_wr));
 }
 
-int on_connection_client(struct rdma_cm_id *id)
+int on_connection_client(struct rdma_cm_id *id, const struct rdma_conn_param *param)
 {
-    on_connect_client(id->context);
+    struct connection_client *conn = (struct connection_client *)id->context;
+    const struct message *msg = param->private_data;
+
+    on_connect_client(conn);
+
+    /* the server handed its region over with the accept, so there is no MSG_MR to wait for */
+    if (param->private_data_len >= sizeof(struct message) && msg->version == MSG_VERSION && msg->type == MSG_MR)
+    {
+        set_server_mr(conn, msg);
+        start_reads(conn);
+    }
     return 0;
 }
 
 void register_memory_client(struct connection_client *conn)
 {
     conn->recv_msg = malloc(sizeof(struct message));
-    conn->rdma_local_region = malloc(RDMA_BUFFER_SIZE);
+    TEST_Z(conn->rdma_local_region = region_alloc(&conn->local_region, RDMA_BUFFER_SIZE));
     bzero(conn->recv_msg, sizeof(struct message));
-    bzero(conn->rdma_local_region, RDMA_BUFFER_SIZE);
+    /* the read overwrites it anyway; under odp only the pages it lands on should become resident */
+    if (REGION_REG_MODE == REGION_REG_PINNED)
+        region_fill(&conn->local_region, RDMA_BUFFER_SIZE, "", 1);
     TEST_Z(conn->recv_mr = ibv_reg_mr(s_ctx->pd, conn->recv_msg, sizeof(struct message), IBV_ACCESS_LOCAL_WRITE));
-    TEST_Z(conn->rdma_local_mr = ibv_reg_mr(s_ctx->pd, conn->rdma_local_region, RDMA_BUFFER_SIZE, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ));
+    TEST_Z(conn->rdma_local_mr = region_reg_mr(&conn->local_region, s_ctx->pd, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ));
+    region_report("local region", &conn->local_region);
 	
     conn->send_msg = malloc(sizeof(struct message));
     bzero(conn->send_msg, sizeof(struct message));
@@ -127,17 +190,20 @@ void build_qp_attr_client(struct ibv_qp_init_attr *qp_attr)
     qp_attr->send_cq = s_ctx->cq;
     qp_attr->recv_cq = s_ctx->cq;
     qp_attr->qp_type = IBV_QPT_RC;
-    qp_attr->cap.max_send_wr = 10;
+    qp_attr->cap.max_send_wr = QUEUE_DEPTH + 1;
     qp_attr->cap.max_recv_wr = 10;
-    qp_attr->cap.max_send_sge = 1;
+    qp_attr->cap.max_send_sge = SCATTER_SGE ? SCATTER_SGE : 1;
     qp_attr->cap.max_recv_sge = 1;
+    qp_attr->cap.max_inline_data = sizeof(struct message);
 }
 
 void build_params_client(struct rdma_conn_param *params)
 {
     memset(params, 0, sizeof(*params));
 
-    params->initiator_depth = params->responder_resources = 1;
+    /* ask the server to keep every read of the window in flight; QUEUE_DEPTH is already within max_qp_init_rd_atom */
+    params->initiator_depth = QUEUE_DEPTH;
+    params->responder_resources = 1;
     params->rnr_retry_count = 7;
 }
 
@@ -153,12 +219,37 @@ void build_context_client(struct ibv_context *verbs)
 
     s_ctx = (struct context *)malloc(sizeof(struct context));
     s_ctx->ctx = verbs;
+    region_place(s_ctx->ctx);
+    region_report_placement();
+
+    TEST_NZ(ibv_query_device(s_ctx->ctx, &s_ctx->dev_attr));
+
+    /* reads past the rdma read depth only wait in the send queue */
+    if (QUEUE_DEPTH > s_ctx->dev_attr.max_qp_init_rd_atom)
+    {
+        QUEUE_DEPTH = s_ctx->dev_attr.max_qp_init_rd_atom;
+        TEST_Z(QUEUE_DEPTH);
+        printf("queue depth clamped to %d, the device's read depth\n", QUEUE_DEPTH);
+    }
+
+    /* one read scatters into at most max_sge_rd local buffers */
+    if (SCATTER_SGE)
+    {
+        if (SCATTER_SGE > s_ctx->dev_attr.max_sge_rd)
+            SCATTER_SGE = s_ctx->dev_attr.max_sge_rd;
+        if (SCATTER_SGE > s_ctx->dev_attr.max_sge)
+            SCATTER_SGE = s_ctx->dev_attr.max_sge;
+        TEST_Z(SCATTER_SGE);
+        printf("scattering each read into %d blocks\n", SCATTER_SGE);
+    }
 
     TEST_Z(s_ctx->pd = ibv_alloc_pd(s_ctx->ctx));
     TEST_Z(s_ctx->comp_channel = ibv_create_comp_channel(s_ctx->ctx));
-    TEST_Z(s_ctx->cq = ibv_create_cq(s_ctx->ctx, 10, NULL, s_ctx->comp_channel, 0));
+    TEST_Z(s_ctx->cq = ibv_create_cq(s_ctx->ctx, QUEUE_DEPTH + 11, NULL, s_ctx->comp_channel, 0)); /* every send and receive the qp can hold */
     TEST_NZ(ibv_req_notify_cq(s_ctx->cq, 0));
     TEST_NZ(pthread_create(&s_ctx->cq_poller_thread, NULL, poll_cq, NULL));
+    if (region_pin_thread(s_ctx->cq_poller_thread) == 0)
+        printf("cq poller pinned to the placement node\n");
 }
 
 void build_connection_client(struct rdma_cm_id *id)
@@ -172,50 +263,59 @@ void build_connection_client(struct rdma_cm_id *id)
     id->context = conn = (struct connection_client *)malloc(sizeof(struct connection_client));
     conn->id = id;
     conn->qp = id->qp;
-    conn->connected = 0;
+    conn->state = CONN_CONNECTING;
+    TEST_NZ(pthread_mutex_init(&conn->state_lock, NULL));
+    TEST_Z(conn->pending_sends = calloc(MAX_PENDING_SENDS, sizeof(struct message)));
+    conn->num_pending_sends = 0;
+    conn->setup_cpu_us = 0;
     register_memory_client(conn);
     post_receives(conn);
 }
 
-int largest_prime_smaller_n(int n)
-{
-	for(int i = n; i >= 2; i--)
-	{
-		int j = 2;
-		for(j = 2; j < i; j++)
-		{
-			if(i % j == 0)
-				break;
-		}
-		if(j >= i)
-			return i;
-	}
-	return 2;
-}
-
-void random_num(int offset_num)
-{
-    unsigned long addr = 0;
-    unsigned long step = 513 * 4096;
-    rand_offset = (unsigned long*)malloc(sizeof(unsigned long)*offset_num);
-    for(int i = 0; i < offset_num; i++)
-    {
-        addr += step;
-        while(addr >= offset_num)
-            addr -= offset_num;
-        rand_offset[i] = addr;
-    }
-}
-
 int main(int argc, char **argv)
 {
     struct addrinfo *addr;
     struct rdma_cm_event *event = NULL;
     struct rdma_cm_id *conn = NULL;
     struct rdma_event_channel *ec = NULL;
+    int op;
+
+    while ((op = getopt(argc, argv, "H:O:N:F:S:q:s:")) != -1)
+    {
+        switch (op)
+        {
+        case 'H':
+            if (region_set_backend(optarg))
+                usage(argv[0]);
+            break;
+        case 'O':
+            if (region_set_reg_mode(optarg))
+                usage(argv[0]);
+            break;
+        case 'N':
+            if (region_set_numa(optarg))
+                usage(argv[0]);
+            break;
+        case 'F':
+            REGION_FILL_THREADS = atoi(optarg);
+            break;
+        case 'S':
+            TEST_Z(SCATTER_SGE = atoi(optarg));
+            break;
+        case 'q':
+            TEST_Z(QUEUE_DEPTH = atoi(optarg));
+            break;
+        case 's':
+            PERMUTE_SEED = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
 
-    if (argc != 5)
+    if (argc - optind != 4)
         usage(argv[0]);
+    argv += optind - 1;
 
     TEST_Z(RDMA_BLOCK_SIZE = atoi(argv[4]));
 
@@ -227,14 +327,20 @@ int main(int argc, char **argv)
 
     freeaddrinfo(addr);
 
-    max_prime = largest_prime_smaller_n(RDMA_BUFFER_SIZE/RDMA_BLOCK_SIZE);
-    random_num(max_prime);
+    permute_init(&block_perm, RDMA_BUFFER_SIZE / RDMA_BLOCK_SIZE, PERMUTE_SEED);
 
     while (rdma_get_cm_event(ec, &event) == 0)
     {
         struct rdma_cm_event event_copy;
+        uint8_t private_data[UINT8_MAX];
 
         memcpy(&event_copy, event, sizeof(*event));
+        /* the private data goes away with the event once it is acked */
+        if (event->event == RDMA_CM_EVENT_ESTABLISHED && event->param.conn.private_data_len)
+        {
+            memcpy(private_data, event->param.conn.private_data, event->param.conn.private_data_len);
+            event_copy.param.conn.private_data = private_data;
+        }
         rdma_ack_cm_event(event);
 
         if (on_event(&event_copy))
@@ -255,7 +361,14 @@ int on_addr_resolved(struct rdma_cm_id *id)
 
 void on_connect_client(void *context)
 {
-    ((struct connection_client *)context)->connected = 1;
+    struct connection_client *conn = (struct connection_client *)context;
+
+    pthread_mutex_lock(&conn->state_lock);
+    conn->state = CONN_ESTABLISHED;
+    for (int i = 0; i < conn->num_pending_sends; i++)
+        post_message(conn, &conn->pending_sends[i]);
+    conn->num_pending_sends = 0;
+    pthread_mutex_unlock(&conn->state_lock);
 }
 
 int on_connection(struct rdma_cm_id *id)
@@ -277,13 +390,15 @@ void destroy_connection_client(void *context)
 
     rdma_destroy_qp(conn->id);
     ibv_dereg_mr(conn->recv_mr);
-    ibv_dereg_mr(conn->rdma_local_mr);
+    region_dereg_mr(&conn->local_region, conn->rdma_local_mr);
 
     free(conn->recv_msg);
-    free(conn->rdma_local_region);
+    region_free(&conn->local_region);
 
     rdma_destroy_id(conn->id);
 
+    free(conn->pending_sends);
+    pthread_mutex_destroy(&conn->state_lock);
     free(conn);
 }
 
@@ -297,6 +412,8 @@ int on_disconnect_client(struct rdma_cm_id *id)
 int on_event(struct rdma_cm_event *event)
 {
     int r = 0;
+    double cpu = thread_cpu_us();
+
     switch (event->event)
     {
     case RDMA_CM_EVENT_ADDR_RESOLVED:
@@ -306,7 +423,7 @@ int on_event(struct rdma_cm_event *event)
         r = on_route_resolved(event->id);
         break;
     case RDMA_CM_EVENT_ESTABLISHED:
-        r = on_connection_client(event->id);
+        r = on_connection_client(event->id, &event->param.conn);
         break;
     case RDMA_CM_EVENT_DISCONNECTED:
         r = on_disconnect_client(event->id);
@@ -315,6 +432,16 @@ int on_event(struct rdma_cm_event *event)
         die("on_event: unknown event.");
         break;
     }
+
+    /* what the cm thread spends on a connection until it is established is its setup cost */
+    if (event->event == RDMA_CM_EVENT_ADDR_RESOLVED || event->event == RDMA_CM_EVENT_ROUTE_RESOLVED || event->event == RDMA_CM_EVENT_ESTABLISHED)
+    {
+        struct connection_client *conn = (struct connection_client *)event->id->context;
+
+        conn->setup_cpu_us += thread_cpu_us() - cpu;
+        if (event->event == RDMA_CM_EVENT_ESTABLISHED)
+            printf("connection set up with %lf us of cpu.\n", conn->setup_cpu_us);
+    }
     return r;
 }
 
@@ -323,6 +450,7 @@ int on_route_resolved(struct rdma_cm_id *id)
     struct rdma_conn_param cm_params;
 
     build_params_client(&cm_params);
+    connect_start = get_cycles();
     TEST_NZ(rdma_connect(id, &cm_params));
 
     return 0;
@@ -330,11 +458,12 @@ int on_route_resolved(struct rdma_cm_id *id)
 
 void usage(const char *argv0)
 {
-    fprintf(stderr, "usage: %s <mode> <server-address> <server-port> <block-size>\n  mode = \"read\", \"write\"\n", argv0);
+    fprintf(stderr, "usage: %s [-H pages] [-O reg] [-N numa-node] [-F fill-threads] [-S sge] [-q queue-depth] [-s seed] <mode> <server-address> <server-port> <block-size>\n  mode = \"read\", \"write\"\n  pages = \"malloc\", \"2m\", \"1g\" or a hugetlbfs mount\n  reg = \"pinned\", \"odp\", \"implicit\"\n  numa-node = node number or \"off\", default is the node of the device\n  fill-threads = threads that first touch the buffers, default one per cpu of the node\n  sge = read runs of this many blocks from the server, scattered locally; by default every block is read from a random offset\n  queue-depth = reads kept in flight, default 16, at most the device's read depth\n  seed = picks the random block order, default 1\n", argv0);
     exit(1);
 }
 
-void send_message(struct connection_client *conn)
+/* control messages go inline, so msg does not have to be registered */
+void post_message(struct connection_client *conn, struct message *msg)
 {
     struct ibv_send_wr wr, *bad_wr = NULL;
     struct ibv_sge sge;
@@ -344,46 +473,118 @@ void send_message(struct connection_client *conn)
     wr.opcode = IBV_WR_SEND;
     wr.sg_list = &sge;
     wr.num_sge = 1;
-    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.send_flags = IBV_SEND_SIGNALED | IBV_SEND_INLINE;
 
-    sge.addr = (uintptr_t)conn->send_msg;
+    sge.addr = (uintptr_t)msg;
     sge.length = sizeof(struct message);
     sge.lkey = conn->send_mr->lkey;
 
-    while(!conn->connected);
-
     TEST_NZ(ibv_post_send(conn->qp, &wr, &bad_wr));
 }
 
+void send_message(struct connection_client *conn)
+{
+    pthread_mutex_lock(&conn->state_lock);
+    if (conn->state == CONN_ESTABLISHED)
+        post_message(conn, conn->send_msg);
+    else if (conn->num_pending_sends < MAX_PENDING_SENDS)
+        conn->pending_sends[conn->num_pending_sends++] = *conn->send_msg;
+    else
+        die("send_message: too many sends before the connection was established.");
+    pthread_mutex_unlock(&conn->state_lock);
+}
+
 void send_read_finish(struct connection_client *conn)
 {
-    memset(conn->send_msg, 0, sizeof(struct message));
+    conn->send_msg->version = MSG_VERSION;
     conn->send_msg->type = MSG_DONE;
+    conn->send_msg->seq++;
     send_message(conn);
 }
 
 
+/* block b of the local buffer is read from the server's block permuted_block(b), one block per read; called with read_lock held */
 void post_rdma_read_client(struct connection_client *conn)
 {
     struct ibv_send_wr wr, *bad_wr = NULL;
     struct ibv_sge sge;
 
+    if (SCATTER_SGE)
+    {
+        post_scatter_read(conn);
+        return;
+    }
+
     memset(&wr, 0, sizeof(wr));
     wr.wr_id = (uintptr_t)conn;
     wr.opcode = IBV_WR_RDMA_READ;
     wr.sg_list = &sge;
     wr.num_sge = 1;
     wr.send_flags = IBV_SEND_SIGNALED;
-    wr.wr.rdma.remote_addr = (uintptr_t)conn->server_mr.addr;
+    wr.wr.rdma.remote_addr = (uintptr_t)conn->server_mr.addr + permuted_block(read_next) * RDMA_BLOCK_SIZE;
     wr.wr.rdma.rkey = conn->server_mr.rkey;
 
-    sge.addr = (uintptr_t)conn->rdma_local_region;
-    sge.length = RDMA_BUFFER_SIZE;
+    sge.addr = (uintptr_t)(conn->rdma_local_region + read_next * RDMA_BLOCK_SIZE);
+    sge.length = RDMA_BLOCK_SIZE;
     sge.lkey = conn->rdma_local_mr->lkey;
 
+    read_next++;
     TEST_NZ(ibv_post_send(conn->qp, &wr, &bad_wr));
 }
 
+unsigned long permuted_block(unsigned long b)
+{
+    return permute_at(&block_perm, b);
+}
+
+void start_reads(struct connection_client *conn)
+{
+    unsigned long num_blocks = RDMA_BUFFER_SIZE / RDMA_BLOCK_SIZE;
+    int blocks_per_read = SCATTER_SGE ? SCATTER_SGE : 1;
+
+    pthread_mutex_lock(&read_lock);
+    start = get_cycles();
+    read_next = reads_done = 0;
+    reads_total = (num_blocks + blocks_per_read - 1) / blocks_per_read;
+    for (int i = 0; i < QUEUE_DEPTH && read_next < num_blocks; i++)
+        post_rdma_read_client(conn);
+    pthread_mutex_unlock(&read_lock);
+}
+
+/* a run of remote blocks in order, remote block b landing in local block permuted_block(b) */
+void post_scatter_read(struct connection_client *conn)
+{
+    struct ibv_send_wr wr, *bad_wr = NULL;
+    struct ibv_sge sge[SCATTER_SGE];
+    unsigned long num_blocks = RDMA_BUFFER_SIZE / RDMA_BLOCK_SIZE;
+    int n = 0;
+
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = (uintptr_t)conn;
+    wr.opcode = IBV_WR_RDMA_READ;
+    wr.sg_list = sge;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.wr.rdma.remote_addr = (uintptr_t)conn->server_mr.addr + read_next * RDMA_BLOCK_SIZE;
+    wr.wr.rdma.rkey = conn->server_mr.rkey;
+
+    for (; n < SCATTER_SGE && read_next < num_blocks; n++, read_next++)
+    {
+        sge[n].addr = (uintptr_t)(conn->rdma_local_region + permuted_block(read_next) * RDMA_BLOCK_SIZE);
+        sge[n].length = RDMA_BLOCK_SIZE;
+        sge[n].lkey = conn->rdma_local_mr->lkey;
+    }
+    wr.num_sge = n;
+
+    TEST_NZ(ibv_post_send(conn->qp, &wr, &bad_wr));
+}
+
+void set_server_mr(struct connection_client *conn, const struct message *msg)
+{
+    conn->server_mr.addr = (void *)(uintptr_t)msg->addr;
+    conn->server_mr.rkey = msg->rkey;
+    conn->server_mr.length = msg->length;
+}
+
 void on_completion_client(struct ibv_wc *wc)
 {
     struct connection_client *conn = (struct connection_client *)(uintptr_t)wc->wr_id;
@@ -393,41 +594,81 @@ void on_completion_client(struct ibv_wc *wc)
 
     if (wc->opcode & IBV_WC_RECV)
     {
+        if (conn->recv_msg->version != MSG_VERSION)
+            die("on_completion: unknown message version.");
+
         printf("recv success\n");
         
         if (conn->recv_msg->type == MSG_MR)
-        {
-            memcpy(&conn->server_mr, &conn->recv_msg->data.mr, sizeof(conn->server_mr));
-        }
-        start = get_cycles();   
-        post_rdma_read_client(conn);
+            set_server_mr(conn, conn->recv_msg);
+        start_reads(conn);
     }
     else
     {
-        for(int i = 0; i < max_prime; i++) {
-            point = conn->rdma_local_region + rand_offset[i];
+        pthread_mutex_lock(&read_lock);
+        if (++reads_done == 1)
+            first_byte = get_cycles();
+
+        /* keep QUEUE_DEPTH reads in flight until the whole buffer is in */
+        if (reads_done < reads_total)
+        {
+            if (read_next < RDMA_BUFFER_SIZE / RDMA_BLOCK_SIZE)
+                post_rdma_read_client(conn);
+            pthread_mutex_unlock(&read_lock);
+            return;
         }
-        
+        pthread_mutex_unlock(&read_lock);
+
         FILE *fp;
         TEST_Z(fp = fopen("./data-cas-random", "a"));
 
         end = get_cycles();
         cycles_to_units = get_cpu_mhz(0) * 1000000;
         sum_of_test_cycles = (double)(end - start);
+        printf("connect to first byte : %lf us\n", (first_byte - connect_start) * 1000000 / cycles_to_units);
+        printf("%lu reads of %d block(s), %s, queue depth %d\n", reads_total, SCATTER_SGE ? SCATTER_SGE : 1,
+               SCATTER_SGE ? "scattered locally" : "random remote offsets", QUEUE_DEPTH);
         double tp_avg = ((double) RDMA_BUFFER_SIZE * cycles_to_units) / (sum_of_test_cycles * 0x100000);
         //double bw_avg = ((double) RDMA_BUFFER_SIZE * cycles_to_units) / (sum_of_test_cycles * 0x100000);
         //printf("\nsum_of_test_cycles : %lf\n", sum_of_test_cycles);
         //printf("\ncpu time : %lf s, cpu frequency : %lf hz\n bandwidth : %lf MB/s, throughput : %lf MB/s\n", sum_of_test_cycles/cycles_to_units, cycles_to_units, bw_avg, tp_avg);
-        fprintf(fp, "%lu cputime(s) %lf throughput(MB/s) %lf\n", RDMA_BLOCK_SIZE, sum_of_test_cycles/cycles_to_units, tp_avg);
+        fprintf(fp, "%lu cputime(s) %lf throughput(MB/s) %lf mr-pages %lu regtime(s) %lf\n", RDMA_BLOCK_SIZE, sum_of_test_cycles/cycles_to_units, tp_avg,
+                (unsigned long)(conn->local_region.length / conn->local_region.page_size), conn->local_region.reg_cycles / cycles_to_units);
         fclose(fp);
+        print_cq_batch_hist();
         rdma_disconnect(conn->id);
     }
 }
 
+/* bucket i counts polls that drained [2^i, 2^(i+1)) completions at once */
+void record_cq_batch(int n)
+{
+    int i = 0;
+
+    while (n >>= 1)
+        i++;
+    if (i >= CQ_BATCH_HIST_SIZE)
+        i = CQ_BATCH_HIST_SIZE - 1;
+    cq_batch_hist[i]++;
+}
+
+void print_cq_batch_hist(void)
+{
+    printf("cq poll batch histogram (batch %d):\n", CQ_POLL_BATCH);
+    for (int i = 0; i < CQ_BATCH_HIST_SIZE; i++)
+    {
+        if (cq_batch_hist[i])
+            printf("  %5d - %5d : %lu\n", 1 << i, (1 << (i + 1)) - 1, cq_batch_hist[i]);
+    }
+}
+
 void *poll_cq(void *context)
 {
     struct ibv_cq *cq;
-    struct ibv_wc wc;
+    struct ibv_wc *wc;
+    int n;
+
+    TEST_Z(wc = calloc(CQ_POLL_BATCH, sizeof(struct ibv_wc)));
 
     while (1)
     {
@@ -435,8 +676,14 @@ void *poll_cq(void *context)
         ibv_ack_cq_events(cq, 1);
         TEST_NZ(ibv_req_notify_cq(cq, 0));
 
-        while (ibv_poll_cq(cq, 1, &wc))
-            on_completion_client(&wc);
+        while ((n = ibv_poll_cq(cq, CQ_POLL_BATCH, wc)) != 0)
+        {
+            if (n < 0)
+                die("poll_cq: ibv_poll_cq failed.");
+            record_cq_batch(n);
+            for (int i = 0; i < n; i++)
+                on_completion_client(&wc[i]);
+        }
     }
 
     return NULL;
@@ -3,36 +3,57 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 #include <rdma/rdma_cma.h>
+#include "region.h"
 
 #define TEST_NZ(x) do { if ( (x)) die("error: " #x " failed (returned non-zero)." ); } while (0)
 #define TEST_Z(x)  do { if (!(x)) die("error: " #x " failed (returned zero/null)."); } while (0)
 
 unsigned long RDMA_BUFFER_SIZE = 1024 * 1024 * 1024;
 
-struct message
+enum
 {
-    enum
-    {
-        MSG_MR,
-        MSG_DONE
-    } type;
-
-    union {
-        struct ibv_mr mr;
-    } data;
+    MSG_MR,
+    MSG_DONE
 };
 
+#define MSG_VERSION 1
+#define MAX_PENDING_SENDS 4
+
+/* control message as it goes on the wire: fixed width, packed and small enough to send inline */
+struct message
+{
+    uint8_t version;
+    uint8_t type;
+    uint16_t reserved;
+    uint32_t rkey;
+    uint64_t addr;
+    uint32_t length;
+    uint32_t seq;
+    uint64_t index;
+} __attribute__((packed));
+
 struct connection_server
 {
     struct rdma_cm_id *id;
     struct ibv_qp *qp;
 
-    int connected;
+    /* control sends made before ESTABLISHED wait in pending_sends until on_connect posts them */
+    enum
+    {
+        CONN_CONNECTING,
+        CONN_ESTABLISHED
+    } state;
+    pthread_mutex_t state_lock;
+    struct message *pending_sends;
+    int num_pending_sends;
+    double setup_cpu_us;
 
     struct ibv_mr *rdma_remote_mr;
     struct message *send_msg;
     struct ibv_mr *send_mr;
+    struct region remote_region;
     char *rdma_remote_region;
 	
     struct message *recv_msg;
@@ -52,18 +73,28 @@ struct context
     struct ibv_pd *pd;
     struct ibv_cq *cq;
     struct ibv_comp_channel *comp_channel;
+    struct ibv_device_attr dev_attr;
 
     pthread_t cq_poller_thread;
 };
 
+#define CQ_BATCH_HIST_SIZE 16
+
+int CQ_POLL_BATCH = 16;
+unsigned long cq_batch_hist[CQ_BATCH_HIST_SIZE];
+
 static struct context *s_ctx = NULL;
 
-static int on_connect_request(struct rdma_cm_id *id);
+static int on_connect_request(struct rdma_cm_id *id, struct rdma_conn_param *req);
 static int on_connection_server(struct rdma_cm_id *id);
 static int on_disconnect_server(struct rdma_cm_id *id);
 static int on_event(struct rdma_cm_event *event);
+void post_message(struct connection_server *conn, struct message *msg);
 static void usage(const char *argv0);
 void *poll_cq(void *context);
+void record_cq_batch(int n);
+void print_cq_batch_hist(void);
+void build_mr_message(struct connection_server *conn);
 
 
 
@@ -73,6 +104,14 @@ void die(const char *reason)
     exit(EXIT_FAILURE);
 }
 
+double thread_cpu_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
 void build_context_server(struct ibv_context *verbs)
 {
     if (s_ctx)
@@ -85,12 +124,17 @@ void build_context_server(struct ibv_context *verbs)
 
     s_ctx = (struct context *)malloc(sizeof(struct context));
     s_ctx->ctx = verbs;
+    region_place(s_ctx->ctx);
+    region_report_placement();
+    TEST_NZ(ibv_query_device(s_ctx->ctx, &s_ctx->dev_attr));
 
     TEST_Z(s_ctx->pd = ibv_alloc_pd(s_ctx->ctx));
     TEST_Z(s_ctx->comp_channel = ibv_create_comp_channel(s_ctx->ctx));
     TEST_Z(s_ctx->cq = ibv_create_cq(s_ctx->ctx, 10, NULL, s_ctx->comp_channel, 0));
     TEST_NZ(ibv_req_notify_cq(s_ctx->cq, 0));
     TEST_NZ(pthread_create(&s_ctx->cq_poller_thread, NULL, poll_cq, NULL));
+    if (region_pin_thread(s_ctx->cq_poller_thread) == 0)
+        printf("cq poller pinned to the placement node\n");
 }
 
 void post_receives_server(struct connection_server *conn)
@@ -113,13 +157,14 @@ void post_receives_server(struct connection_server *conn)
 void register_memory_server(struct connection_server *conn)
 {
     conn->send_msg = malloc(sizeof(struct message));
-    conn->rdma_remote_region = malloc(RDMA_BUFFER_SIZE);
+    TEST_Z(conn->rdma_remote_region = region_alloc(&conn->remote_region, RDMA_BUFFER_SIZE));
     bzero(conn->send_msg, sizeof(struct message));
-    memset(conn->rdma_remote_region, 'a', RDMA_BUFFER_SIZE);
+    region_fill(&conn->remote_region, RDMA_BUFFER_SIZE, "a", 1);
     
 
     TEST_Z(conn->send_mr = ibv_reg_mr(s_ctx->pd, conn->send_msg, sizeof(struct message), IBV_ACCESS_LOCAL_WRITE));
-    TEST_Z(conn->rdma_remote_mr = ibv_reg_mr(s_ctx->pd, conn->rdma_remote_region, RDMA_BUFFER_SIZE, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ));
+    TEST_Z(conn->rdma_remote_mr = region_reg_mr(&conn->remote_region, s_ctx->pd, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ));
+    region_report("remote region", &conn->remote_region);
 
     conn->recv_msg = malloc(sizeof(struct message));
     bzero(conn->recv_msg, sizeof(struct message));
@@ -136,13 +181,20 @@ void build_qp_attr_server(struct ibv_qp_init_attr *qp_attr)
     qp_attr->cap.max_recv_wr = 10;
     qp_attr->cap.max_send_sge = 1;
     qp_attr->cap.max_recv_sge = 1;
+    qp_attr->cap.max_inline_data = sizeof(struct message);
 }
 
-void build_params_server(struct rdma_conn_param *params)
+void build_params_server(struct rdma_conn_param *params, struct rdma_conn_param *req)
 {
+    int rd_atom = req->initiator_depth;
+
     memset(params, 0, sizeof(*params));
 
-    params->initiator_depth = params->responder_resources = 1;
+    /* serve as many outstanding reads as the client asked for and we can hold */
+    if (rd_atom > s_ctx->dev_attr.max_qp_rd_atom)
+        rd_atom = s_ctx->dev_attr.max_qp_rd_atom;
+    params->responder_resources = rd_atom;
+    params->initiator_depth = 1;
     params->rnr_retry_count = 7;
 }
 
@@ -157,7 +209,11 @@ void build_connection_server(struct rdma_cm_id *id)
     id->context = conn = (struct connection_server *)malloc(sizeof(struct connection_server));
     conn->id = id;
     conn->qp = id->qp;
-    conn->connected = 0;
+    conn->state = CONN_CONNECTING;
+    TEST_NZ(pthread_mutex_init(&conn->state_lock, NULL));
+    TEST_Z(conn->pending_sends = calloc(MAX_PENDING_SENDS, sizeof(struct message)));
+    conn->num_pending_sends = 0;
+    conn->setup_cpu_us = 0;
     register_memory_server(conn);
 }
 
@@ -168,9 +224,35 @@ int main(int argc, char **argv)
     struct rdma_cm_id *listener = NULL;
     struct rdma_event_channel *ec = NULL;
     uint16_t port = 0;
+    int op;
 
-    if (argc != 3)
+    while ((op = getopt(argc, argv, "H:O:N:F:")) != -1)
+    {
+        switch (op)
+        {
+        case 'H':
+            if (region_set_backend(optarg))
+                usage(argv[0]);
+            break;
+        case 'O':
+            if (region_set_reg_mode(optarg))
+                usage(argv[0]);
+            break;
+        case 'N':
+            if (region_set_numa(optarg))
+                usage(argv[0]);
+            break;
+        case 'F':
+            REGION_FILL_THREADS = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (argc - optind != 2)
         usage(argv[0]);
+    argv += optind - 1;
 
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
@@ -203,12 +285,19 @@ int main(int argc, char **argv)
     return 0;
 }
 
-int on_connect_request(struct rdma_cm_id *id)
+int on_connect_request(struct rdma_cm_id *id, struct rdma_conn_param *req)
 {
     struct rdma_conn_param cm_params;
+    struct connection_server *conn;
 
     build_connection_server(id);
-    build_params_server(&cm_params);
+    conn = (struct connection_server *)id->context;
+    build_params_server(&cm_params, req);
+
+    /* hand the region over with the accept so the client can read as soon as it is established */
+    build_mr_message(conn);
+    cm_params.private_data = conn->send_msg;
+    cm_params.private_data_len = sizeof(struct message);
 
     TEST_NZ(rdma_accept(id, &cm_params));
 
@@ -217,10 +306,18 @@ int on_connect_request(struct rdma_cm_id *id)
 
 void on_connect_server(void *context)
 {
-    ((struct connection_server *)context)->connected = 1;
+    struct connection_server *conn = (struct connection_server *)context;
+
+    pthread_mutex_lock(&conn->state_lock);
+    conn->state = CONN_ESTABLISHED;
+    for (int i = 0; i < conn->num_pending_sends; i++)
+        post_message(conn, &conn->pending_sends[i]);
+    conn->num_pending_sends = 0;
+    pthread_mutex_unlock(&conn->state_lock);
 }
 
-void send_message(struct connection_server *conn)
+/* control messages go inline, so msg does not have to be registered */
+void post_message(struct connection_server *conn, struct message *msg)
 {
     struct ibv_send_wr wr, *bad_wr = NULL;
     struct ibv_sge sge;
@@ -230,29 +327,40 @@ void send_message(struct connection_server *conn)
     wr.opcode = IBV_WR_SEND;
     wr.sg_list = &sge;
     wr.num_sge = 1;
-    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.send_flags = IBV_SEND_SIGNALED | IBV_SEND_INLINE;
 
-    sge.addr = (uintptr_t)conn->send_msg;
+    sge.addr = (uintptr_t)msg;
     sge.length = sizeof(struct message);
     sge.lkey = conn->send_mr->lkey;
 
-    while (!conn->connected);     
-
     TEST_NZ(ibv_post_send(conn->qp, &wr, &bad_wr));
 }
 
-void send_mr(void *context)
+void send_message(struct connection_server *conn)
 {
-    struct connection_server *conn = (struct connection_server *)context;
+    pthread_mutex_lock(&conn->state_lock);
+    if (conn->state == CONN_ESTABLISHED)
+        post_message(conn, conn->send_msg);
+    else if (conn->num_pending_sends < MAX_PENDING_SENDS)
+        conn->pending_sends[conn->num_pending_sends++] = *conn->send_msg;
+    else
+        die("send_message: too many sends before the connection was established.");
+    pthread_mutex_unlock(&conn->state_lock);
+}
+
+void build_mr_message(struct connection_server *conn)
+{
+    conn->send_msg->version = MSG_VERSION;
     conn->send_msg->type = MSG_MR;
-    memcpy(&conn->send_msg->data.mr, conn->rdma_remote_mr, sizeof(struct ibv_mr));
-    send_message(conn);
+    conn->send_msg->seq++;
+    conn->send_msg->addr = (uintptr_t)conn->rdma_remote_region;
+    conn->send_msg->rkey = conn->rdma_remote_mr->rkey;
+    conn->send_msg->length = RDMA_BUFFER_SIZE;
 }
 
 int on_connection_server(struct rdma_cm_id *id)
 {
     on_connect_server(id->context);
-    send_mr(id->context);
     return 0;
 }
 
@@ -262,19 +370,22 @@ void destroy_connection_server(void *context)
 
     rdma_destroy_qp(conn->id);
     ibv_dereg_mr(conn->send_mr);
-    ibv_dereg_mr(conn->rdma_remote_mr);
+    region_dereg_mr(&conn->remote_region, conn->rdma_remote_mr);
 
     free(conn->send_msg);
-    free(conn->rdma_remote_region);
+    region_free(&conn->remote_region);
 
     rdma_destroy_id(conn->id);
 
+    free(conn->pending_sends);
+    pthread_mutex_destroy(&conn->state_lock);
     free(conn);
 }
 
 int on_disconnect_server(struct rdma_cm_id *id)
 {
     printf("peer disconnected.\n");
+    print_cq_batch_hist();
     destroy_connection_server(id->context);
     return 0;
 }
@@ -282,11 +393,12 @@ int on_disconnect_server(struct rdma_cm_id *id)
 int on_event(struct rdma_cm_event *event)
 {
     int r = 0;
+    double cpu = thread_cpu_us();
 
     switch (event->event)
     {
     case RDMA_CM_EVENT_CONNECT_REQUEST:
-        r = on_connect_request(event->id);
+        r = on_connect_request(event->id, &event->param.conn);
         break;
     case RDMA_CM_EVENT_ESTABLISHED:
         r = on_connection_server(event->id);
@@ -298,12 +410,22 @@ int on_event(struct rdma_cm_event *event)
         die("on_event: unknown event.");
         break;
     }
+
+    /* what the cm thread spends on a connection until it is established is its setup cost */
+    if (event->event == RDMA_CM_EVENT_CONNECT_REQUEST || event->event == RDMA_CM_EVENT_ESTABLISHED)
+    {
+        struct connection_server *conn = (struct connection_server *)event->id->context;
+
+        conn->setup_cpu_us += thread_cpu_us() - cpu;
+        if (event->event == RDMA_CM_EVENT_ESTABLISHED)
+            printf("connection set up with %lf us of cpu.\n", conn->setup_cpu_us);
+    }
     return r;
 }
 
 void usage(const char *argv0)
 {
-    fprintf(stderr, "usage: %s <mode> <server-port>\n  mode = \"read\", \"write\"\n", argv0);
+    fprintf(stderr, "usage: %s [-H pages] [-O reg] [-N numa-node] [-F fill-threads] <mode> <server-port>\n  mode = \"read\", \"write\"\n  pages = \"malloc\", \"2m\", \"1g\" or a hugetlbfs mount\n  reg = \"pinned\", \"odp\", \"implicit\"\n  numa-node = node number or \"off\", default is the node of the device\n  fill-threads = threads that first touch the buffers, default one per cpu of the node\n", argv0);
     exit(1);
 }
 
@@ -316,6 +438,9 @@ void on_completion_server(struct ibv_wc *wc)
 
     if (wc->opcode & IBV_WC_RECV)
     {
+        if (conn->recv_msg->version != MSG_VERSION)
+            die("on_completion: unknown message version.");
+
         printf("\nrecv success\n");
         if (conn->recv_msg->type == MSG_DONE){
             printf("Client read finish\n");
@@ -329,10 +454,35 @@ void on_completion_server(struct ibv_wc *wc)
     }
 }
 
+/* bucket i counts polls that drained [2^i, 2^(i+1)) completions at once */
+void record_cq_batch(int n)
+{
+    int i = 0;
+
+    while (n >>= 1)
+        i++;
+    if (i >= CQ_BATCH_HIST_SIZE)
+        i = CQ_BATCH_HIST_SIZE - 1;
+    cq_batch_hist[i]++;
+}
+
+void print_cq_batch_hist(void)
+{
+    printf("cq poll batch histogram (batch %d):\n", CQ_POLL_BATCH);
+    for (int i = 0; i < CQ_BATCH_HIST_SIZE; i++)
+    {
+        if (cq_batch_hist[i])
+            printf("  %5d - %5d : %lu\n", 1 << i, (1 << (i + 1)) - 1, cq_batch_hist[i]);
+    }
+}
+
 void *poll_cq(void *context)
 {
     struct ibv_cq *cq;
-    struct ibv_wc wc;
+    struct ibv_wc *wc;
+    int n;
+
+    TEST_Z(wc = calloc(CQ_POLL_BATCH, sizeof(struct ibv_wc)));
 
     while (1)
     {
@@ -340,8 +490,14 @@ void *poll_cq(void *context)
         ibv_ack_cq_events(cq, 1);
         TEST_NZ(ibv_req_notify_cq(cq, 0));
 
-        while (ibv_poll_cq(cq, 1, &wc))
-            on_completion_server(&wc);
+        while ((n = ibv_poll_cq(cq, CQ_POLL_BATCH, wc)) != 0)
+        {
+            if (n < 0)
+                die("poll_cq: ibv_poll_cq failed.");
+            record_cq_batch(n);
+            for (int i = 0; i < n; i++)
+                on_completion_server(&wc[i]);
+        }
     }
 
     return NULL;
@@ -0,0 +1,478 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/vfs.h>
+#include "mr_cache.h"
+#include "region.h"
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+#define PAGE_4K (4UL << 10)
+#define FILL_MAX_THREADS 16
+#define PLACE_MAX_CPUS 1024
+#define PLACE_MAX_NODES 1024
+#define MPOL_PREFERRED 1
+#define FILL_COPY_CHUNK (64UL << 10)
+#define PAGE_2M (2UL << 20)
+#define PAGE_1G (1UL << 30)
+
+enum region_backend REGION_BACKEND = REGION_MALLOC;
+const char *REGION_HUGETLBFS_DIR = NULL;
+enum region_reg REGION_REG_MODE = REGION_REG_PINNED;
+int REGION_FILL_THREADS = 0;
+int REGION_NUMA_NODE = REGION_NODE_DEVICE;
+
+static int place_node = -1;
+static int place_cpus[PLACE_MAX_CPUS];
+static int place_num_cpus;
+static const char *place_source = "not set";
+
+static const char *backend_names[] = { "malloc", "2m", "1g", "hugetlbfs" };
+const char *region_reg_names[] = { "pinned", "odp", "implicit" };
+
+int region_set_backend(const char *name)
+{
+    if (name[0] == '/')
+    {
+        REGION_HUGETLBFS_DIR = name;
+        REGION_BACKEND = REGION_HUGETLBFS;
+        return 0;
+    }
+    for (int i = 0; i < REGION_HUGETLBFS; i++)
+    {
+        if (strcmp(name, backend_names[i]) == 0)
+        {
+            REGION_BACKEND = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int region_set_reg_mode(const char *name)
+{
+    for (int i = 0; i < sizeof(region_reg_names) / sizeof(region_reg_names[0]); i++)
+    {
+        if (strcmp(name, region_reg_names[i]) == 0)
+        {
+            REGION_REG_MODE = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* cpus listed in a cpulist string such as "0-7,16-23", at most max of them */
+static int parse_cpulist(const char *list, int *cpus, int max)
+{
+    int n = 0, lo, hi;
+    char *end;
+
+    while (*list && n < max)
+    {
+        lo = hi = strtol(list, &end, 10);
+        if (end == list)
+            break;
+        if (*end == '-')
+            hi = strtol(end + 1, &end, 10);
+        for (int c = lo; c <= hi && n < max; c++)
+            cpus[n++] = c;
+        list = (*end == ',') ? end + 1 : end;
+    }
+    return n;
+}
+
+static int read_sysfs(const char *path, char *buf, int size)
+{
+    FILE *f;
+    int ok;
+
+    if (!(f = fopen(path, "r")))
+        return -1;
+    ok = fgets(buf, size, f) != NULL;
+    fclose(f);
+    return ok ? 0 : -1;
+}
+
+/* "off", or the number of the node to use instead of the device's */
+int region_set_numa(const char *arg)
+{
+    char *end;
+
+    if (strcmp(arg, "off") == 0)
+    {
+        REGION_NUMA_NODE = REGION_NODE_OFF;
+        return 0;
+    }
+    REGION_NUMA_NODE = strtol(arg, &end, 10);
+    return (end == arg || *end || REGION_NUMA_NODE < 0) ? -1 : 0;
+}
+
+/*
+ * pick the numa node regions and pollers are placed on: the node the rdma
+ * device sits on according to sysfs, unless overridden. Later regions are
+ * bound to it and region_pin_thread() keeps threads on its cpus.
+ */
+void region_place(struct ibv_context *ctx)
+{
+    char path[256], buf[4096];
+
+    if (place_num_cpus || REGION_NUMA_NODE == REGION_NODE_OFF)
+    {
+        if (!place_num_cpus)
+            place_source = "off";
+        return;
+    }
+
+    if (REGION_NUMA_NODE >= 0)
+    {
+        place_node = REGION_NUMA_NODE;
+        place_source = "override";
+    }
+    else
+    {
+        snprintf(path, sizeof(path), "/sys/class/infiniband/%s/device/numa_node", ibv_get_device_name(ctx->device));
+        /* -1 here means the platform does not report one */
+        if (read_sysfs(path, buf, sizeof(buf)) || (place_node = atoi(buf)) < 0)
+        {
+            place_node = -1;
+            place_source = "unknown to sysfs";
+            return;
+        }
+        place_source = ibv_get_device_name(ctx->device);
+    }
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", place_node);
+    if (read_sysfs(path, buf, sizeof(buf)) == 0)
+        place_num_cpus = parse_cpulist(buf, place_cpus, PLACE_MAX_CPUS);
+}
+
+int region_pin_thread(pthread_t thread)
+{
+    cpu_set_t set;
+
+    if (!place_num_cpus)
+        return -1;
+
+    CPU_ZERO(&set);
+    for (int i = 0; i < place_num_cpus; i++)
+        CPU_SET(place_cpus[i], &set);
+    return pthread_setaffinity_np(thread, sizeof(set), &set);
+}
+
+void region_report_placement(void)
+{
+    if (place_node < 0)
+        printf("placement : none (%s)\n", place_source);
+    else
+        printf("placement : node %d (%s), %d cpus from %d\n", place_node, place_source, place_num_cpus, place_num_cpus ? place_cpus[0] : -1);
+}
+
+/* prefer the placement node for pages not yet touched; returns the node or -1 */
+static int bind_node(void *addr, size_t length)
+{
+    unsigned long mask[PLACE_MAX_NODES / (8 * sizeof(unsigned long))] = { 0 };
+
+    if (place_node < 0 || place_node >= PLACE_MAX_NODES)
+        return -1;
+    mask[place_node / (8 * sizeof(unsigned long))] |= 1UL << (place_node % (8 * sizeof(unsigned long)));
+    if (syscall(SYS_mbind, addr, length, MPOL_PREFERRED, mask, PLACE_MAX_NODES, 0))
+        return -1;
+    return place_node;
+}
+
+static size_t round_up(size_t length, size_t page_size)
+{
+    return (length + page_size - 1) & ~(page_size - 1);
+}
+
+static void *map_anon_huge(struct region *r, size_t length, size_t page_size, int flag)
+{
+    void *p = mmap(NULL, round_up(length, page_size), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | flag, -1, 0);
+
+    if (p == MAP_FAILED)
+        return NULL;
+    r->length = round_up(length, page_size);
+    r->page_size = page_size;
+    return p;
+}
+
+static void *map_hugetlbfs(struct region *r, size_t length)
+{
+    char path[4096];
+    struct statfs fs;
+    void *p;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/rdma-region-XXXXXX", REGION_HUGETLBFS_DIR);
+    if ((fd = mkstemp(path)) < 0)
+        return NULL;
+    unlink(path);
+
+    /* f_bsize of a hugetlbfs mount is its huge page size */
+    if (fstatfs(fd, &fs) || ftruncate(fd, round_up(length, fs.f_bsize)))
+    {
+        close(fd);
+        return NULL;
+    }
+    p = mmap(NULL, round_up(length, fs.f_bsize), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+    {
+        close(fd);
+        return NULL;
+    }
+    r->fd = fd;
+    r->length = round_up(length, fs.f_bsize);
+    r->page_size = fs.f_bsize;
+    return p;
+}
+
+void *region_alloc(struct region *r, size_t length)
+{
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+
+    switch (REGION_BACKEND)
+    {
+    case REGION_HUGETLBFS:
+        if ((r->addr = map_hugetlbfs(r, length)))
+        {
+            r->backend = REGION_HUGETLBFS;
+            break;
+        }
+        fprintf(stderr, "region: no hugetlbfs file in %s, trying 1g pages\n", REGION_HUGETLBFS_DIR);
+        /* fall through */
+    case REGION_HUGE_1G:
+        if ((r->addr = map_anon_huge(r, length, PAGE_1G, MAP_HUGE_1GB)))
+        {
+            r->backend = REGION_HUGE_1G;
+            break;
+        }
+        fprintf(stderr, "region: no 1g pages, trying 2m pages\n");
+        /* fall through */
+    case REGION_HUGE_2M:
+        if ((r->addr = map_anon_huge(r, length, PAGE_2M, MAP_HUGE_2MB)))
+        {
+            r->backend = REGION_HUGE_2M;
+            break;
+        }
+        fprintf(stderr, "region: no 2m pages, using malloc\n");
+        /* fall through */
+    case REGION_MALLOC:
+        if (posix_memalign(&r->addr, PAGE_4K, length))
+            r->addr = NULL;
+        r->backend = REGION_MALLOC;
+        r->length = length;
+        r->page_size = PAGE_4K;
+        break;
+    }
+
+    r->node = r->addr ? bind_node(r->addr, round_up(r->length, PAGE_4K)) : -1;
+    return r->addr;
+}
+
+void region_free(struct region *r)
+{
+    if (!r->addr)
+        return;
+
+    mr_cache_invalidate(r->addr, r->length);
+    if (r->backend == REGION_MALLOC)
+        free(r->addr);
+    else
+        munmap(r->addr, r->length);
+    if (r->fd >= 0)
+        close(r->fd);
+    r->addr = NULL;
+}
+
+/* the best registration mode the device supports for rc traffic with this access, up to want */
+static enum region_reg odp_mode(struct ibv_context *ctx, int access, enum region_reg want)
+{
+    struct ibv_device_attr_ex attr;
+    uint32_t need = IBV_ODP_SUPPORT_READ;
+
+    if (want == REGION_REG_PINNED || ibv_query_device_ex(ctx, NULL, &attr))
+        return REGION_REG_PINNED;
+
+    if (access & IBV_ACCESS_REMOTE_WRITE)
+        need |= IBV_ODP_SUPPORT_WRITE;
+    if (!(attr.odp_caps.general_caps & IBV_ODP_SUPPORT) || (attr.odp_caps.per_transport_caps.rc_odp_caps & need) != need)
+    {
+        fprintf(stderr, "region: no odp support for rc, registering pinned\n");
+        return REGION_REG_PINNED;
+    }
+    if (want == REGION_REG_IMPLICIT && !(attr.odp_caps.general_caps & IBV_ODP_SUPPORT_IMPLICIT))
+    {
+        fprintf(stderr, "region: no implicit odp, registering the region only\n");
+        return REGION_REG_ODP;
+    }
+    return want;
+}
+
+struct ibv_mr *region_reg_mr(struct region *r, struct ibv_pd *pd, int access)
+{
+    cycles_t t0 = get_cycles();
+    struct ibv_mr *mr = NULL;
+
+    r->reg = odp_mode(pd->context, access, REGION_REG_MODE);
+
+    /* the mr is left as the library made it: advertise r->addr and r->length, not its bounds */
+    if (r->reg == REGION_REG_IMPLICIT && !(mr = ibv_reg_mr(pd, NULL, SIZE_MAX, access | IBV_ACCESS_ON_DEMAND)))
+        r->reg = REGION_REG_ODP;
+    if (r->reg == REGION_REG_ODP && !(mr = ibv_reg_mr(pd, r->addr, r->length, access | IBV_ACCESS_ON_DEMAND)))
+        r->reg = REGION_REG_PINNED;
+    if (r->reg == REGION_REG_PINNED)
+        mr = mr_cache_get(pd, r->addr, r->length, access);
+
+    r->reg_cycles = get_cycles() - t0;
+    return mr;
+}
+
+void region_dereg_mr(struct region *r, struct ibv_mr *mr)
+{
+    if (r->reg == REGION_REG_PINNED)
+        mr_cache_put(mr);
+    else
+        ibv_dereg_mr(mr);
+}
+
+struct fill_job
+{
+    char *start;
+    size_t length;
+    const char *pattern;
+    size_t pattern_len;
+    int cpu;
+    pthread_t thread;
+    int created;                /* thread is only valid when set */
+};
+
+static void *fill_worker(void *arg)
+{
+    struct fill_job *job = arg;
+    size_t done, n;
+
+    /* first touch from a placement cpu, so the pages land on its node even without the bind */
+    if (job->cpu >= 0)
+    {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(job->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    if (job->pattern_len == 1)
+    {
+        memset(job->start, job->pattern[0], job->length);
+        return NULL;
+    }
+
+    /* lay the pattern down once, then copy it forward in cache-sized chunks with memcpy's wide stores */
+    done = job->pattern_len < job->length ? job->pattern_len : job->length;
+    memcpy(job->start, job->pattern, done);
+    while (done < job->length)
+    {
+        n = done < FILL_COPY_CHUNK ? done : FILL_COPY_CHUNK;
+        if (n > job->length - done)
+            n = job->length - done;
+        memcpy(job->start + done, job->start, n);
+        done += n;
+    }
+    return NULL;
+}
+
+/*
+ * fill the first length bytes of the region with a repeating pattern, split
+ * into page-aligned slices over REGION_FILL_THREADS threads (0 means one per
+ * placement cpu, up to FILL_MAX_THREADS)
+ */
+void region_fill(struct region *r, size_t length, const char *pattern, size_t pattern_len)
+{
+    struct fill_job jobs[FILL_MAX_THREADS];
+    int *cpus = place_cpus;
+    int num_cpus = place_num_cpus;
+    int threads = REGION_FILL_THREADS;
+    cycles_t t0 = get_cycles();
+    size_t slice;
+
+    if (threads <= 0)
+        threads = num_cpus ? num_cpus : sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > FILL_MAX_THREADS)
+        threads = FILL_MAX_THREADS;
+    /* every slice has to start in phase with the pattern */
+    if (threads < 1 || PAGE_4K % pattern_len)
+        threads = 1;
+
+    slice = (length / threads + PAGE_4K - 1) & ~(PAGE_4K - 1);
+    for (int i = 0; i < threads; i++)
+    {
+        size_t off = i * slice;
+
+        jobs[i].start = (char *)r->addr + off;
+        jobs[i].length = off >= length ? 0 : (length - off < slice ? length - off : slice);
+        jobs[i].pattern = pattern;
+        jobs[i].pattern_len = pattern_len;
+        jobs[i].cpu = num_cpus ? cpus[i % num_cpus] : -1;
+        jobs[i].created = !pthread_create(&jobs[i].thread, NULL, fill_worker, &jobs[i]);
+        if (!jobs[i].created)
+        {
+            jobs[i].cpu = -1;
+            fill_worker(&jobs[i]);
+        }
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        if (jobs[i].created)
+            pthread_join(jobs[i].thread, NULL);
+    }
+
+    r->fill_threads = threads;
+    r->fill_cycles = get_cycles() - t0;
+}
+
+/* every page is one translation entry the nic has to hold for the mr */
+void region_report(const char *name, struct region *r)
+{
+    double mhz = get_cpu_mhz(0);
+
+    printf("%s : %s, %lu bytes in %lu pages of %lu KB, node %d, rss %ld KB\n",
+           name, backend_names[r->backend], (unsigned long)r->length,
+           (unsigned long)(r->length / r->page_size), (unsigned long)(r->page_size >> 10), r->node, region_rss_kb());
+    if (r->reg_cycles)
+        printf("%s : registered %s in %lf s\n", name, region_reg_names[r->reg], r->reg_cycles / (mhz * 1000000));
+    if (r->fill_threads)
+        printf("%s : filled by %d threads in %lf s\n", name, r->fill_threads, r->fill_cycles / (mhz * 1000000));
+}
+
+/* resident set of the whole process, from /proc/self/statm */
+long region_rss_kb(void)
+{
+    FILE *f = fopen("/proc/self/statm", "r");
+    long size, resident = 0;
+
+    if (!f)
+        return -1;
+    if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+        resident = -1;
+    fclose(f);
+    return resident < 0 ? -1 : resident * (sysconf(_SC_PAGESIZE) >> 10);
+}
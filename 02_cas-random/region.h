@@ -0,0 +1,86 @@
+#ifndef REGION_H
+#define REGION_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <infiniband/verbs.h>
+#include "get_clock.h"
+
+/*
+ * Backing store for the large data buffers. The hugepage backends fall back
+ * to the next smaller page size, and finally to plain 4 KB pages, so a
+ * region can always be allocated.
+ */
+enum region_backend
+{
+    REGION_MALLOC,
+    REGION_HUGE_2M,
+    REGION_HUGE_1G,
+    REGION_HUGETLBFS
+};
+
+/*
+ * How the region is registered. On-demand paging lets the NIC fault pages
+ * in as they are touched instead of pinning them all in ibv_reg_mr; an
+ * implicit mr covers the whole address space. Both fall back to pinning
+ * when the device cannot do them.
+ */
+enum region_reg
+{
+    REGION_REG_PINNED,
+    REGION_REG_ODP,
+    REGION_REG_IMPLICIT
+};
+
+struct region
+{
+    void *addr;
+    size_t length;              /* rounded up to page_size */
+    size_t page_size;
+    enum region_backend backend;  /* what was actually used */
+    enum region_reg reg;          /* likewise */
+    int fd;
+    cycles_t reg_cycles;
+    cycles_t fill_cycles;
+    int fill_threads;
+    int node;                     /* numa node the pages are bound to, -1 if none */
+};
+
+extern enum region_backend REGION_BACKEND;
+extern const char *REGION_HUGETLBFS_DIR;
+extern enum region_reg REGION_REG_MODE;
+extern int REGION_FILL_THREADS;
+
+#define REGION_NODE_DEVICE -1
+#define REGION_NODE_OFF -2
+extern int REGION_NUMA_NODE;
+extern const char *region_reg_names[];
+
+/* "malloc", "2m", "1g" or the path of a hugetlbfs mount */
+int region_set_backend(const char *name);
+
+/* "pinned", "odp" or "implicit" */
+int region_set_reg_mode(const char *name);
+
+void *region_alloc(struct region *r, size_t length);
+void region_free(struct region *r);
+
+/* "off" or a node number; by default the node of the rdma device is used */
+int region_set_numa(const char *arg);
+void region_place(struct ibv_context *ctx);
+int region_pin_thread(pthread_t thread);
+void region_report_placement(void);
+
+void region_fill(struct region *r, size_t length, const char *pattern, size_t pattern_len);
+
+/*
+ * pinned registrations go through the mr cache, so a re-registration is usually a hit.
+ * an implicit mr spans the whole address space, so its addr and length say
+ * nothing about the region: hand peers r->addr and r->length instead.
+ */
+struct ibv_mr *region_reg_mr(struct region *r, struct ibv_pd *pd, int access);
+void region_dereg_mr(struct region *r, struct ibv_mr *mr);
+void region_report(const char *name, struct region *r);
+long region_rss_kb(void);
+
+#endif
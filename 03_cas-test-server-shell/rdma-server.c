@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 #include <rdma/rdma_cma.h>
 
 #define TEST_NZ(x) do { if ( (x)) die("error: " #x " failed (returned non-zero)." ); } while (0)
@@ -10,25 +11,43 @@
 
 unsigned long RDMA_BUFFER_SIZE = 1024 * 1024 * 1024;
 
-struct message
+enum
 {
-    enum
-    {
-        MSG_MR,
-        MSG_DONE
-    } type;
-
-    union {
-        struct ibv_mr mr;
-    } data;
+    MSG_MR,
+    MSG_DONE
 };
 
+#define MSG_VERSION 1
+#define MAX_PENDING_SENDS 4
+
+/* control message as it goes on the wire: fixed width, packed and small enough to send inline */
+struct message
+{
+    uint8_t version;
+    uint8_t type;
+    uint16_t reserved;
+    uint32_t rkey;
+    uint64_t addr;
+    uint32_t length;
+    uint32_t seq;
+    uint64_t index;
+} __attribute__((packed));
+
 struct connection_server
 {
     struct rdma_cm_id *id;
     struct ibv_qp *qp;
 
-    int connected;
+    /* control sends made before ESTABLISHED wait in pending_sends until on_connect posts them */
+    enum
+    {
+        CONN_CONNECTING,
+        CONN_ESTABLISHED
+    } state;
+    pthread_mutex_t state_lock;
+    struct message *pending_sends;
+    int num_pending_sends;
+    double setup_cpu_us;
 
     struct ibv_mr *rdma_remote_mr;
     struct message *send_msg;
@@ -56,14 +75,23 @@ struct context
     pthread_t cq_poller_thread;
 };
 
+#define CQ_BATCH_HIST_SIZE 16
+
+int CQ_POLL_BATCH = 16;
+unsigned long cq_batch_hist[CQ_BATCH_HIST_SIZE];
+
 static struct context *s_ctx = NULL;
 
 static int on_connect_request(struct rdma_cm_id *id);
 static int on_connection_server(struct rdma_cm_id *id);
 static int on_disconnect_server(struct rdma_cm_id *id);
 static int on_event(struct rdma_cm_event *event);
+void post_message(struct connection_server *conn, struct message *msg);
 static void usage(const char *argv0);
 void *poll_cq(void *context);
+void record_cq_batch(int n);
+void print_cq_batch_hist(void);
+void build_mr_message(struct connection_server *conn);
 
 
 
@@ -73,6 +101,14 @@ void die(const char *reason)
     exit(EXIT_FAILURE);
 }
 
+double thread_cpu_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
 void build_context_server(struct ibv_context *verbs)
 {
     if (s_ctx)
@@ -136,6 +172,7 @@ void build_qp_attr_server(struct ibv_qp_init_attr *qp_attr)
     qp_attr->cap.max_recv_wr = 10;
     qp_attr->cap.max_send_sge = 1;
     qp_attr->cap.max_recv_sge = 1;
+    qp_attr->cap.max_inline_data = sizeof(struct message);
 }
 
 void build_params_server(struct rdma_conn_param *params)
@@ -157,7 +194,11 @@ void build_connection_server(struct rdma_cm_id *id)
     id->context = conn = (struct connection_server *)malloc(sizeof(struct connection_server));
     conn->id = id;
     conn->qp = id->qp;
-    conn->connected = 0;
+    conn->state = CONN_CONNECTING;
+    TEST_NZ(pthread_mutex_init(&conn->state_lock, NULL));
+    TEST_Z(conn->pending_sends = calloc(MAX_PENDING_SENDS, sizeof(struct message)));
+    conn->num_pending_sends = 0;
+    conn->setup_cpu_us = 0;
     register_memory_server(conn);
 }
 
@@ -208,10 +249,17 @@ int main(int argc, char **argv)
 int on_connect_request(struct rdma_cm_id *id)
 {
     struct rdma_conn_param cm_params;
+    struct connection_server *conn;
 
     build_connection_server(id);
+    conn = (struct connection_server *)id->context;
     build_params_server(&cm_params);
 
+    /* hand the region over with the accept so the client can read as soon as it is established */
+    build_mr_message(conn);
+    cm_params.private_data = conn->send_msg;
+    cm_params.private_data_len = sizeof(struct message);
+
     TEST_NZ(rdma_accept(id, &cm_params));
 
     return 0;
@@ -219,10 +267,18 @@ int on_connect_request(struct rdma_cm_id *id)
 
 void on_connect_server(void *context)
 {
-    ((struct connection_server *)context)->connected = 1;
+    struct connection_server *conn = (struct connection_server *)context;
+
+    pthread_mutex_lock(&conn->state_lock);
+    conn->state = CONN_ESTABLISHED;
+    for (int i = 0; i < conn->num_pending_sends; i++)
+        post_message(conn, &conn->pending_sends[i]);
+    conn->num_pending_sends = 0;
+    pthread_mutex_unlock(&conn->state_lock);
 }
 
-void send_message(struct connection_server *conn)
+/* control messages go inline, so msg does not have to be registered */
+void post_message(struct connection_server *conn, struct message *msg)
 {
     struct ibv_send_wr wr, *bad_wr = NULL;
     struct ibv_sge sge;
@@ -232,29 +288,40 @@ void send_message(struct connection_server *conn)
     wr.opcode = IBV_WR_SEND;
     wr.sg_list = &sge;
     wr.num_sge = 1;
-    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.send_flags = IBV_SEND_SIGNALED | IBV_SEND_INLINE;
 
-    sge.addr = (uintptr_t)conn->send_msg;
+    sge.addr = (uintptr_t)msg;
     sge.length = sizeof(struct message);
     sge.lkey = conn->send_mr->lkey;
 
-    while (!conn->connected);     
-
     TEST_NZ(ibv_post_send(conn->qp, &wr, &bad_wr));
 }
 
-void send_mr(void *context)
+void send_message(struct connection_server *conn)
 {
-    struct connection_server *conn = (struct connection_server *)context;
+    pthread_mutex_lock(&conn->state_lock);
+    if (conn->state == CONN_ESTABLISHED)
+        post_message(conn, conn->send_msg);
+    else if (conn->num_pending_sends < MAX_PENDING_SENDS)
+        conn->pending_sends[conn->num_pending_sends++] = *conn->send_msg;
+    else
+        die("send_message: too many sends before the connection was established.");
+    pthread_mutex_unlock(&conn->state_lock);
+}
+
+void build_mr_message(struct connection_server *conn)
+{
+    conn->send_msg->version = MSG_VERSION;
     conn->send_msg->type = MSG_MR;
-    memcpy(&conn->send_msg->data.mr, conn->rdma_remote_mr, sizeof(struct ibv_mr));
-    send_message(conn);
+    conn->send_msg->seq++;
+    conn->send_msg->addr = (uintptr_t)conn->rdma_remote_region;
+    conn->send_msg->rkey = conn->rdma_remote_mr->rkey;
+    conn->send_msg->length = RDMA_BUFFER_SIZE;
 }
 
 int on_connection_server(struct rdma_cm_id *id)
 {
     on_connect_server(id->context);
-    send_mr(id->context);
     return 0;
 }
 
@@ -271,12 +338,15 @@ void destroy_connection_server(void *context)
 
     rdma_destroy_id(conn->id);
 
+    free(conn->pending_sends);
+    pthread_mutex_destroy(&conn->state_lock);
     free(conn);
 }
 
 int on_disconnect_server(struct rdma_cm_id *id)
 {
     printf("peer disconnected.\n");
+    print_cq_batch_hist();
     destroy_connection_server(id->context);
     return 1;
 }
@@ -284,6 +354,7 @@ int on_disconnect_server(struct rdma_cm_id *id)
 int on_event(struct rdma_cm_event *event)
 {
     int r = 0;
+    double cpu = thread_cpu_us();
 
     switch (event->event)
     {
@@ -300,6 +371,16 @@ int on_event(struct rdma_cm_event *event)
         die("on_event: unknown event.");
         break;
     }
+
+    /* what the cm thread spends on a connection until it is established is its setup cost */
+    if (event->event == RDMA_CM_EVENT_CONNECT_REQUEST || event->event == RDMA_CM_EVENT_ESTABLISHED)
+    {
+        struct connection_server *conn = (struct connection_server *)event->id->context;
+
+        conn->setup_cpu_us += thread_cpu_us() - cpu;
+        if (event->event == RDMA_CM_EVENT_ESTABLISHED)
+            printf("connection set up with %lf us of cpu.\n", conn->setup_cpu_us);
+    }
     return r;
 }
 
@@ -318,6 +399,9 @@ void on_completion_server(struct ibv_wc *wc)
 
     if (wc->opcode & IBV_WC_RECV)
     {
+        if (conn->recv_msg->version != MSG_VERSION)
+            die("on_completion: unknown message version.");
+
         printf("\nrecv success\n");
         if (conn->recv_msg->type == MSG_DONE){
             printf("Client read finish\n");
@@ -331,10 +415,35 @@ void on_completion_server(struct ibv_wc *wc)
     }
 }
 
+/* bucket i counts polls that drained [2^i, 2^(i+1)) completions at once */
+void record_cq_batch(int n)
+{
+    int i = 0;
+
+    while (n >>= 1)
+        i++;
+    if (i >= CQ_BATCH_HIST_SIZE)
+        i = CQ_BATCH_HIST_SIZE - 1;
+    cq_batch_hist[i]++;
+}
+
+void print_cq_batch_hist(void)
+{
+    printf("cq poll batch histogram (batch %d):\n", CQ_POLL_BATCH);
+    for (int i = 0; i < CQ_BATCH_HIST_SIZE; i++)
+    {
+        if (cq_batch_hist[i])
+            printf("  %5d - %5d : %lu\n", 1 << i, (1 << (i + 1)) - 1, cq_batch_hist[i]);
+    }
+}
+
 void *poll_cq(void *context)
 {
     struct ibv_cq *cq;
-    struct ibv_wc wc;
+    struct ibv_wc *wc;
+    int n;
+
+    TEST_Z(wc = calloc(CQ_POLL_BATCH, sizeof(struct ibv_wc)));
 
     while (1)
     {
@@ -342,8 +451,14 @@ void *poll_cq(void *context)
         ibv_ack_cq_events(cq, 1);
         TEST_NZ(ibv_req_notify_cq(cq, 0));
 
-        while (ibv_poll_cq(cq, 1, &wc))
-            on_completion_server(&wc);
+        while ((n = ibv_poll_cq(cq, CQ_POLL_BATCH, wc)) != 0)
+        {
+            if (n < 0)
+                die("poll_cq: ibv_poll_cq failed.");
+            record_cq_batch(n);
+            for (int i = 0; i < n; i++)
+                on_completion_server(&wc[i]);
+        }
     }
 
     return NULL;
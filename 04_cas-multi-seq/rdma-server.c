@@ -3,37 +3,61 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 #include <rdma/rdma_cma.h>
+#include "get_clock.h"
 
 #define TEST_NZ(x) do { if ( (x)) die("error: " #x " failed (returned non-zero)." ); } while (0)
 #define TEST_Z(x)  do { if (!(x)) die("error: " #x " failed (returned zero/null)."); } while (0)
 
 unsigned long RDMA_BUFFER_SIZE = 1024 * 1024 * 1024;
+int RDMA_READ_VIEWS = 0;
 
-struct message
-{
-    enum
-    {
-        MSG_MR,
-        MSG_DONE
-    } type;
+double cpu_mhz;
+int accepted_conns = 0;
 
-    union {
-        struct ibv_mr mr;
-    } data;
+enum
+{
+    MSG_MR,
+    MSG_DONE
 };
 
+#define MSG_VERSION 1
+#define MAX_PENDING_SENDS 4
+
+/* control message as it goes on the wire: fixed width, packed and small enough to send inline */
+struct message
+{
+    uint8_t version;
+    uint8_t type;
+    uint16_t reserved;
+    uint32_t rkey;
+    uint64_t addr;
+    uint32_t length;
+    uint32_t seq;
+    uint64_t index;
+} __attribute__((packed));
+
 struct connection_server
 {
     struct rdma_cm_id *id;
     struct ibv_qp *qp;
 
-    int connected;
-
-    struct ibv_mr *rdma_remote_mr;
+    /* control sends made before ESTABLISHED wait in pending_sends until on_connect posts them */
+    enum
+    {
+        CONN_CONNECTING,
+        CONN_ESTABLISHED
+    } state;
+    pthread_mutex_t state_lock;
+    struct message *pending_sends;
+    int num_pending_sends;
+    double setup_cpu_us;
+
+    struct ibv_mw *view_mw;
+    uint32_t view_rkey;
     struct message *send_msg;
     struct ibv_mr *send_mr;
-    char *rdma_remote_region;
 	
     struct message *recv_msg;
     struct ibv_mr *recv_mr;
@@ -52,18 +76,32 @@ struct context
     struct ibv_pd *pd;
     struct ibv_cq *cq;
     struct ibv_comp_channel *comp_channel;
+    struct ibv_device_attr dev_attr;
+
+    /* one data region handed to every connection, built before the first accept */
+    char *rdma_remote_region;
+    struct ibv_mr *rdma_remote_mr;
 
     pthread_t cq_poller_thread;
 };
 
+#define CQ_BATCH_HIST_SIZE 16
+
+int CQ_POLL_BATCH = 16;
+unsigned long cq_batch_hist[CQ_BATCH_HIST_SIZE];
+
 static struct context *s_ctx = NULL;
 
 static int on_connect_request(struct rdma_cm_id *id);
 static int on_connection_server(struct rdma_cm_id *id);
 static int on_disconnect_server(struct rdma_cm_id *id);
 static int on_event(struct rdma_cm_event *event);
+void post_message(struct connection_server *conn, struct message *msg);
 static void usage(const char *argv0);
 void *poll_cq(void *context);
+void record_cq_batch(int n);
+void print_cq_batch_hist(void);
+void build_mr_message(struct connection_server *conn);
 
 
 
@@ -73,6 +111,35 @@ void die(const char *reason)
     exit(EXIT_FAILURE);
 }
 
+double thread_cpu_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+void build_shared_region_server(void)
+{
+    int access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ;
+    cycles_t t0 = get_cycles();
+
+    if (RDMA_READ_VIEWS && !(s_ctx->dev_attr.device_cap_flags & (IBV_DEVICE_MEM_WINDOW_TYPE_2A | IBV_DEVICE_MEM_WINDOW_TYPE_2B)))
+    {
+        printf("device has no type 2 memory windows, clients share the region rkey.\n");
+        RDMA_READ_VIEWS = 0;
+    }
+    /* with views the mr itself grants no remote access: clients only ever get a window's rkey */
+    if (RDMA_READ_VIEWS)
+        access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_MW_BIND;
+
+    TEST_Z(s_ctx->rdma_remote_region = malloc(RDMA_BUFFER_SIZE));
+    memset(s_ctx->rdma_remote_region, 'a', RDMA_BUFFER_SIZE);
+    TEST_Z(s_ctx->rdma_remote_mr = ibv_reg_mr(s_ctx->pd, s_ctx->rdma_remote_region, RDMA_BUFFER_SIZE, access));
+
+    printf("shared region : %lu bytes built and registered in %lf s\n", RDMA_BUFFER_SIZE, (get_cycles() - t0) / (cpu_mhz * 1000000));
+}
+
 void build_context_server(struct ibv_context *verbs)
 {
     if (s_ctx)
@@ -86,7 +153,9 @@ void build_context_server(struct ibv_context *verbs)
     s_ctx = (struct context *)malloc(sizeof(struct context));
     s_ctx->ctx = verbs;
 
+    TEST_NZ(ibv_query_device(s_ctx->ctx, &s_ctx->dev_attr));
     TEST_Z(s_ctx->pd = ibv_alloc_pd(s_ctx->ctx));
+    build_shared_region_server();
     TEST_Z(s_ctx->comp_channel = ibv_create_comp_channel(s_ctx->ctx));
     TEST_Z(s_ctx->cq = ibv_create_cq(s_ctx->ctx, 10, NULL, s_ctx->comp_channel, 0));
     TEST_NZ(ibv_req_notify_cq(s_ctx->cq, 0));
@@ -113,19 +182,39 @@ void post_receives_server(struct connection_server *conn)
 void register_memory_server(struct connection_server *conn)
 {
     conn->send_msg = malloc(sizeof(struct message));
-    conn->rdma_remote_region = malloc(RDMA_BUFFER_SIZE);
     bzero(conn->send_msg, sizeof(struct message));
-    memset(conn->rdma_remote_region, 'a', RDMA_BUFFER_SIZE);
-    
-
     TEST_Z(conn->send_mr = ibv_reg_mr(s_ctx->pd, conn->send_msg, sizeof(struct message), IBV_ACCESS_LOCAL_WRITE));
-    TEST_Z(conn->rdma_remote_mr = ibv_reg_mr(s_ctx->pd, conn->rdma_remote_region, RDMA_BUFFER_SIZE, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ));
 
     conn->recv_msg = malloc(sizeof(struct message));
     bzero(conn->recv_msg, sizeof(struct message));
     TEST_Z(conn->recv_mr = ibv_reg_mr(s_ctx->pd, conn->recv_msg, sizeof(struct message), IBV_ACCESS_LOCAL_WRITE));
 }
 
+/*
+ * a type 2 window over the shared region, bound on this connection's qp: its
+ * rkey is only honoured on that qp, so no other client can read through it.
+ * the bind is unsignaled; the MSG_MR send posted after it completes for both
+ */
+void bind_read_view_server(struct connection_server *conn)
+{
+    struct ibv_send_wr wr, *bad_wr = NULL;
+
+    TEST_Z(conn->view_mw = ibv_alloc_mw(s_ctx->pd, IBV_MW_TYPE_2));
+
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = (uintptr_t)conn;
+    wr.opcode = IBV_WR_BIND_MW;
+    wr.bind_mw.mw = conn->view_mw;
+    wr.bind_mw.rkey = ibv_inc_rkey(conn->view_mw->rkey);
+    wr.bind_mw.bind_info.mr = s_ctx->rdma_remote_mr;
+    wr.bind_mw.bind_info.addr = (uintptr_t)s_ctx->rdma_remote_region;
+    wr.bind_mw.bind_info.length = RDMA_BUFFER_SIZE;
+    wr.bind_mw.bind_info.mw_access_flags = IBV_ACCESS_REMOTE_READ;
+
+    TEST_NZ(ibv_post_send(conn->qp, &wr, &bad_wr));
+    conn->view_rkey = wr.bind_mw.rkey;
+}
+
 void build_qp_attr_server(struct ibv_qp_init_attr *qp_attr)
 {
     memset(qp_attr, 0, sizeof(*qp_attr));
@@ -136,6 +225,7 @@ void build_qp_attr_server(struct ibv_qp_init_attr *qp_attr)
     qp_attr->cap.max_recv_wr = 10;
     qp_attr->cap.max_send_sge = 1;
     qp_attr->cap.max_recv_sge = 1;
+    qp_attr->cap.max_inline_data = sizeof(struct message);
 }
 
 void build_params_server(struct rdma_conn_param *params)
@@ -157,7 +247,12 @@ void build_connection_server(struct rdma_cm_id *id)
     id->context = conn = (struct connection_server *)malloc(sizeof(struct connection_server));
     conn->id = id;
     conn->qp = id->qp;
-    conn->connected = 0;
+    conn->state = CONN_CONNECTING;
+    TEST_NZ(pthread_mutex_init(&conn->state_lock, NULL));
+    TEST_Z(conn->pending_sends = calloc(MAX_PENDING_SENDS, sizeof(struct message)));
+    conn->num_pending_sends = 0;
+    conn->setup_cpu_us = 0;
+    conn->view_mw = NULL;
     register_memory_server(conn);
 }
 
@@ -168,9 +263,23 @@ int main(int argc, char **argv)
     struct rdma_cm_id *listener = NULL;
     struct rdma_event_channel *ec = NULL;
     uint16_t port = 0;
+    int op;
 
-    if (argc != 3)
+    while ((op = getopt(argc, argv, "v")) != -1)
+    {
+        switch (op)
+        {
+        case 'v':
+            RDMA_READ_VIEWS = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (argc - optind != 2)
         usage(argv[0]);
+    argv += optind - 1;
 
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
@@ -182,6 +291,15 @@ int main(int argc, char **argv)
     TEST_NZ(rdma_bind_addr(listener, (struct sockaddr *)&addr));
     TEST_NZ(rdma_listen(listener, 10));
 
+    /*
+     * build the pd and the shared region now so that accepting a client stays cheap.
+     * a wildcard listener has no device yet: then the first connect request builds them
+     * on the device it arrived on
+     */
+    cpu_mhz = get_cpu_mhz(0);
+    if (listener->verbs)
+        build_context_server(listener->verbs);
+
     port = ntohs(rdma_get_src_port(listener));
 
     printf("listening on port %d.\n", port);
@@ -206,21 +324,41 @@ int main(int argc, char **argv)
 int on_connect_request(struct rdma_cm_id *id)
 {
     struct rdma_conn_param cm_params;
+    struct connection_server *conn;
+    cycles_t t0 = get_cycles();
 
     build_connection_server(id);
+    conn = (struct connection_server *)id->context;
     build_params_server(&cm_params);
 
+    /* hand the region over with the accept so the client can read as soon as it is established */
+    if (!RDMA_READ_VIEWS)
+    {
+        build_mr_message(conn);
+        cm_params.private_data = conn->send_msg;
+        cm_params.private_data_len = sizeof(struct message);
+    }
+
     TEST_NZ(rdma_accept(id, &cm_params));
+    printf("client %d accepted in %lf us.\n", ++accepted_conns, (get_cycles() - t0) / cpu_mhz);
 
     return 0;
 }
 
 void on_connect_server(void *context)
 {
-    ((struct connection_server *)context)->connected = 1;
+    struct connection_server *conn = (struct connection_server *)context;
+
+    pthread_mutex_lock(&conn->state_lock);
+    conn->state = CONN_ESTABLISHED;
+    for (int i = 0; i < conn->num_pending_sends; i++)
+        post_message(conn, &conn->pending_sends[i]);
+    conn->num_pending_sends = 0;
+    pthread_mutex_unlock(&conn->state_lock);
 }
 
-void send_message(struct connection_server *conn)
+/* control messages go inline, so msg does not have to be registered */
+void post_message(struct connection_server *conn, struct message *msg)
 {
     struct ibv_send_wr wr, *bad_wr = NULL;
     struct ibv_sge sge;
@@ -230,29 +368,54 @@ void send_message(struct connection_server *conn)
     wr.opcode = IBV_WR_SEND;
     wr.sg_list = &sge;
     wr.num_sge = 1;
-    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.send_flags = IBV_SEND_SIGNALED | IBV_SEND_INLINE;
 
-    sge.addr = (uintptr_t)conn->send_msg;
+    sge.addr = (uintptr_t)msg;
     sge.length = sizeof(struct message);
     sge.lkey = conn->send_mr->lkey;
 
-    while (!conn->connected);     
-
     TEST_NZ(ibv_post_send(conn->qp, &wr, &bad_wr));
 }
 
-void send_mr(void *context)
+void send_message(struct connection_server *conn)
 {
-    struct connection_server *conn = (struct connection_server *)context;
+    pthread_mutex_lock(&conn->state_lock);
+    if (conn->state == CONN_ESTABLISHED)
+        post_message(conn, conn->send_msg);
+    else if (conn->num_pending_sends < MAX_PENDING_SENDS)
+        conn->pending_sends[conn->num_pending_sends++] = *conn->send_msg;
+    else
+        die("send_message: too many sends before the connection was established.");
+    pthread_mutex_unlock(&conn->state_lock);
+}
+
+void build_mr_message(struct connection_server *conn)
+{
+    conn->send_msg->version = MSG_VERSION;
     conn->send_msg->type = MSG_MR;
-    memcpy(&conn->send_msg->data.mr, conn->rdma_remote_mr, sizeof(struct ibv_mr));
-    send_message(conn);
+    conn->send_msg->seq++;
+    conn->send_msg->addr = (uintptr_t)s_ctx->rdma_remote_region;
+    conn->send_msg->rkey = s_ctx->rdma_remote_mr->rkey;
+    conn->send_msg->length = RDMA_BUFFER_SIZE;
+    if (conn->view_mw)
+        conn->send_msg->rkey = conn->view_rkey;
+}
+
+void send_mr(void *context)
+{
+    build_mr_message((struct connection_server *)context);
+    send_message((struct connection_server *)context);
 }
 
 int on_connection_server(struct rdma_cm_id *id)
 {
     on_connect_server(id->context);
-    send_mr(id->context);
+    /* a window can only be bound on a connected qp, so its rkey has to follow in a message */
+    if (RDMA_READ_VIEWS)
+    {
+        bind_read_view_server(id->context);
+        send_mr(id->context);
+    }
     return 0;
 }
 
@@ -260,21 +423,24 @@ void destroy_connection_server(void *context)
 {
     struct connection_server *conn = (struct connection_server *)context;
 
+    if (conn->view_mw)
+        ibv_dealloc_mw(conn->view_mw);
     rdma_destroy_qp(conn->id);
     ibv_dereg_mr(conn->send_mr);
-    ibv_dereg_mr(conn->rdma_remote_mr);
 
     free(conn->send_msg);
-    free(conn->rdma_remote_region);
 
     rdma_destroy_id(conn->id);
 
+    free(conn->pending_sends);
+    pthread_mutex_destroy(&conn->state_lock);
     free(conn);
 }
 
 int on_disconnect_server(struct rdma_cm_id *id)
 {
     printf("peer disconnected.\n");
+    print_cq_batch_hist();
     destroy_connection_server(id->context);
     return 0;
 }
@@ -282,6 +448,7 @@ int on_disconnect_server(struct rdma_cm_id *id)
 int on_event(struct rdma_cm_event *event)
 {
     int r = 0;
+    double cpu = thread_cpu_us();
 
     switch (event->event)
     {
@@ -298,12 +465,22 @@ int on_event(struct rdma_cm_event *event)
         die("on_event: unknown event.");
         break;
     }
+
+    /* what the cm thread spends on a connection until it is established is its setup cost */
+    if (event->event == RDMA_CM_EVENT_CONNECT_REQUEST || event->event == RDMA_CM_EVENT_ESTABLISHED)
+    {
+        struct connection_server *conn = (struct connection_server *)event->id->context;
+
+        conn->setup_cpu_us += thread_cpu_us() - cpu;
+        if (event->event == RDMA_CM_EVENT_ESTABLISHED)
+            printf("connection set up with %lf us of cpu.\n", conn->setup_cpu_us);
+    }
     return r;
 }
 
 void usage(const char *argv0)
 {
-    fprintf(stderr, "usage: %s <mode> <server-port>\n  mode = \"read\", \"write\"\n", argv0);
+    fprintf(stderr, "usage: %s [-v] <mode> <server-port>\n  mode = \"read\", \"write\"\n  -v = give each connection a read-only memory window bound to its qp\n", argv0);
     exit(1);
 }
 
@@ -316,6 +493,9 @@ void on_completion_server(struct ibv_wc *wc)
 
     if (wc->opcode & IBV_WC_RECV)
     {
+        if (conn->recv_msg->version != MSG_VERSION)
+            die("on_completion: unknown message version.");
+
         printf("\nrecv success\n");
         if (conn->recv_msg->type == MSG_DONE){
             printf("Client read finish\n");
@@ -329,10 +509,35 @@ void on_completion_server(struct ibv_wc *wc)
     }
 }
 
+/* bucket i counts polls that drained [2^i, 2^(i+1)) completions at once */
+void record_cq_batch(int n)
+{
+    int i = 0;
+
+    while (n >>= 1)
+        i++;
+    if (i >= CQ_BATCH_HIST_SIZE)
+        i = CQ_BATCH_HIST_SIZE - 1;
+    cq_batch_hist[i]++;
+}
+
+void print_cq_batch_hist(void)
+{
+    printf("cq poll batch histogram (batch %d):\n", CQ_POLL_BATCH);
+    for (int i = 0; i < CQ_BATCH_HIST_SIZE; i++)
+    {
+        if (cq_batch_hist[i])
+            printf("  %5d - %5d : %lu\n", 1 << i, (1 << (i + 1)) - 1, cq_batch_hist[i]);
+    }
+}
+
 void *poll_cq(void *context)
 {
     struct ibv_cq *cq;
-    struct ibv_wc wc;
+    struct ibv_wc *wc;
+    int n;
+
+    TEST_Z(wc = calloc(CQ_POLL_BATCH, sizeof(struct ibv_wc)));
 
     while (1)
     {
@@ -340,8 +545,14 @@ void *poll_cq(void *context)
         ibv_ack_cq_events(cq, 1);
         TEST_NZ(ibv_req_notify_cq(cq, 0));
 
-        while (ibv_poll_cq(cq, 1, &wc))
-            on_completion_server(&wc);
+        while ((n = ibv_poll_cq(cq, CQ_POLL_BATCH, wc)) != 0)
+        {
+            if (n < 0)
+                die("poll_cq: ibv_poll_cq failed.");
+            record_cq_batch(n);
+            for (int i = 0; i < n; i++)
+                on_completion_server(&wc[i]);
+        }
     }
 
     return NULL;
@@ -14,18 +14,24 @@ const int TIMEOUT_IN_MS = 500;
 unsigned long RDMA_BUFFER_SIZE = 1024 * 1024 * 1024;
 unsigned long RDMA_BLOCK_SIZE;
 int offset = 0;
-char *point;
-unsigned long *rand_offset;
-int max_prime;
 
-cycles_t start, end;
+cycles_t connect_start, start, end;
 double cycles_to_units, sum_of_test_cycles;
 
 struct connection_client
 {
     struct rdma_cm_id *id;
     struct ibv_qp *qp;
-    int connected;
+    /* control sends made before ESTABLISHED wait in pending_sends until on_connect posts them */
+    enum
+    {
+        CONN_CONNECTING,
+        CONN_ESTABLISHED
+    } state;
+    pthread_mutex_t state_lock;
+    struct message *pending_sends;
+    int num_pending_sends;
+    double setup_cpu_us;
 
     struct ibv_mr *rdma_local_mr;
     struct message *recv_msg;
@@ -44,19 +50,28 @@ struct connection_client
     } recv_state;
 };
 
-struct message
+enum
 {
-    enum
-    {
-        MSG_MR,
-        MSG_DONE,
-    } type;
-
-    union {
-        struct ibv_mr mr;
-    } data;
+    MSG_MR,
+    MSG_DONE
 };
 
+#define MSG_VERSION 1
+#define MAX_PENDING_SENDS 4
+
+/* control message as it goes on the wire: fixed width, packed and small enough to send inline */
+struct message
+{
+    uint8_t version;
+    uint8_t type;
+    uint16_t reserved;
+    uint32_t rkey;
+    uint64_t addr;
+    uint32_t length;
+    uint32_t seq;
+    uint64_t index;
+} __attribute__((packed));
+
 struct context
 {
     struct ibv_context *ctx;
@@ -66,17 +81,27 @@ struct context
     pthread_t cq_poller_thread;
 };
 
+#define CQ_BATCH_HIST_SIZE 16
+
+int CQ_POLL_BATCH = 16;
+unsigned long cq_batch_hist[CQ_BATCH_HIST_SIZE];
+
 static struct context *s_ctx = NULL;
 
 int on_addr_resolved(struct rdma_cm_id *id);
-int on_connection_client(struct rdma_cm_id *id);
+int on_connection_client(struct rdma_cm_id *id, const struct rdma_conn_param *param);
 int on_disconnect_client(struct rdma_cm_id *id);
 int on_event(struct rdma_cm_event *event);
+void post_message(struct connection_client *conn, struct message *msg);
 int on_route_resolved(struct rdma_cm_id *id);
 void usage(const char *argv0);
 void *poll_cq(void *context);
+void record_cq_batch(int n);
+void print_cq_batch_hist(void);
 void destroy_connection_client(void *context);
 void on_connect_client(void *context);
+void set_server_mr(struct connection_client *conn, const struct message *msg);
+void post_rdma_read_client(struct connection_client *conn);
 
 void die(const char *reason)
 {
@@ -84,6 +109,14 @@ void die(const char *reason)
     exit(EXIT_FAILURE);
 }
 
+double thread_cpu_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
 void post_receives(struct connection_client *conn)
 {
     struct ibv_recv_wr wr, *bad_wr = NULL;
@@ -101,9 +134,20 @@ void post_receives(struct connection_client *conn)
     TEST_NZ(ibv_post_recv(conn->qp, &wr, &bad_wr));
 }
 
-int on_connection_client(struct rdma_cm_id *id)
+int on_connection_client(struct rdma_cm_id *id, const struct rdma_conn_param *param)
 {
-    on_connect_client(id->context);
+    struct connection_client *conn = (struct connection_client *)id->context;
+    const struct message *msg = param->private_data;
+
+    on_connect_client(conn);
+
+    /* the server handed its region over with the accept, so there is no MSG_MR to wait for */
+    if (param->private_data_len >= sizeof(struct message) && msg->version == MSG_VERSION && msg->type == MSG_MR)
+    {
+        set_server_mr(conn, msg);
+        start = get_cycles();
+        post_rdma_read_client(conn);
+    }
     return 0;
 }
 
@@ -131,6 +175,7 @@ void build_qp_attr_client(struct ibv_qp_init_attr *qp_attr)
     qp_attr->cap.max_recv_wr = 10;
     qp_attr->cap.max_send_sge = 1;
     qp_attr->cap.max_recv_sge = 1;
+    qp_attr->cap.max_inline_data = sizeof(struct message);
 }
 
 void build_params_client(struct rdma_conn_param *params)
@@ -172,41 +217,15 @@ void build_connection_client(struct rdma_cm_id *id)
     id->context = conn = (struct connection_client *)malloc(sizeof(struct connection_client));
     conn->id = id;
     conn->qp = id->qp;
-    conn->connected = 0;
+    conn->state = CONN_CONNECTING;
+    TEST_NZ(pthread_mutex_init(&conn->state_lock, NULL));
+    TEST_Z(conn->pending_sends = calloc(MAX_PENDING_SENDS, sizeof(struct message)));
+    conn->num_pending_sends = 0;
+    conn->setup_cpu_us = 0;
     register_memory_client(conn);
     post_receives(conn);
 }
 
-int largest_prime_smaller_n(int n)
-{
-	for(int i = n; i >= 2; i--)
-	{
-		int j = 2;
-		for(j = 2; j < i; j++)
-		{
-			if(i % j == 0)
-				break;
-		}
-		if(j >= i)
-			return i;
-	}
-	return 2;
-}
-
-void random_num(int offset_num)
-{
-    unsigned long addr = 0;
-    unsigned long step = 513 * 4096;
-    rand_offset = (unsigned long*)malloc(sizeof(unsigned long)*offset_num);
-    for(int i = 0; i < offset_num; i++)
-    {
-        addr += step;
-        while(addr >= offset_num)
-            addr -= offset_num;
-        rand_offset[i] = addr;
-    }
-}
-
 int main(int argc, char **argv)
 {
     struct addrinfo *addr;
@@ -227,14 +246,18 @@ int main(int argc, char **argv)
 
     freeaddrinfo(addr);
 
-    max_prime = largest_prime_smaller_n(RDMA_BUFFER_SIZE/RDMA_BLOCK_SIZE);
-    random_num(max_prime);
-
     while (rdma_get_cm_event(ec, &event) == 0)
     {
         struct rdma_cm_event event_copy;
+        uint8_t private_data[UINT8_MAX];
 
         memcpy(&event_copy, event, sizeof(*event));
+        /* the private data goes away with the event once it is acked */
+        if (event->event == RDMA_CM_EVENT_ESTABLISHED && event->param.conn.private_data_len)
+        {
+            memcpy(private_data, event->param.conn.private_data, event->param.conn.private_data_len);
+            event_copy.param.conn.private_data = private_data;
+        }
         rdma_ack_cm_event(event);
 
         if (on_event(&event_copy))
@@ -255,7 +278,14 @@ int on_addr_resolved(struct rdma_cm_id *id)
 
 void on_connect_client(void *context)
 {
-    ((struct connection_client *)context)->connected = 1;
+    struct connection_client *conn = (struct connection_client *)context;
+
+    pthread_mutex_lock(&conn->state_lock);
+    conn->state = CONN_ESTABLISHED;
+    for (int i = 0; i < conn->num_pending_sends; i++)
+        post_message(conn, &conn->pending_sends[i]);
+    conn->num_pending_sends = 0;
+    pthread_mutex_unlock(&conn->state_lock);
 }
 
 int on_connection(struct rdma_cm_id *id)
@@ -284,6 +314,8 @@ void destroy_connection_client(void *context)
 
     rdma_destroy_id(conn->id);
 
+    free(conn->pending_sends);
+    pthread_mutex_destroy(&conn->state_lock);
     free(conn);
 }
 
@@ -297,6 +329,8 @@ int on_disconnect_client(struct rdma_cm_id *id)
 int on_event(struct rdma_cm_event *event)
 {
     int r = 0;
+    double cpu = thread_cpu_us();
+
     switch (event->event)
     {
     case RDMA_CM_EVENT_ADDR_RESOLVED:
@@ -306,7 +340,7 @@ int on_event(struct rdma_cm_event *event)
         r = on_route_resolved(event->id);
         break;
     case RDMA_CM_EVENT_ESTABLISHED:
-        r = on_connection_client(event->id);
+        r = on_connection_client(event->id, &event->param.conn);
         break;
     case RDMA_CM_EVENT_DISCONNECTED:
         r = on_disconnect_client(event->id);
@@ -315,6 +349,16 @@ int on_event(struct rdma_cm_event *event)
         die("on_event: unknown event.");
         break;
     }
+
+    /* what the cm thread spends on a connection until it is established is its setup cost */
+    if (event->event == RDMA_CM_EVENT_ADDR_RESOLVED || event->event == RDMA_CM_EVENT_ROUTE_RESOLVED || event->event == RDMA_CM_EVENT_ESTABLISHED)
+    {
+        struct connection_client *conn = (struct connection_client *)event->id->context;
+
+        conn->setup_cpu_us += thread_cpu_us() - cpu;
+        if (event->event == RDMA_CM_EVENT_ESTABLISHED)
+            printf("connection set up with %lf us of cpu.\n", conn->setup_cpu_us);
+    }
     return r;
 }
 
@@ -323,6 +367,7 @@ int on_route_resolved(struct rdma_cm_id *id)
     struct rdma_conn_param cm_params;
 
     build_params_client(&cm_params);
+    connect_start = get_cycles();
     TEST_NZ(rdma_connect(id, &cm_params));
 
     return 0;
@@ -334,7 +379,8 @@ void usage(const char *argv0)
     exit(1);
 }
 
-void send_message(struct connection_client *conn)
+/* control messages go inline, so msg does not have to be registered */
+void post_message(struct connection_client *conn, struct message *msg)
 {
     struct ibv_send_wr wr, *bad_wr = NULL;
     struct ibv_sge sge;
@@ -344,21 +390,32 @@ void send_message(struct connection_client *conn)
     wr.opcode = IBV_WR_SEND;
     wr.sg_list = &sge;
     wr.num_sge = 1;
-    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.send_flags = IBV_SEND_SIGNALED | IBV_SEND_INLINE;
 
-    sge.addr = (uintptr_t)conn->send_msg;
+    sge.addr = (uintptr_t)msg;
     sge.length = sizeof(struct message);
     sge.lkey = conn->send_mr->lkey;
 
-    while(!conn->connected);
-
     TEST_NZ(ibv_post_send(conn->qp, &wr, &bad_wr));
 }
 
+void send_message(struct connection_client *conn)
+{
+    pthread_mutex_lock(&conn->state_lock);
+    if (conn->state == CONN_ESTABLISHED)
+        post_message(conn, conn->send_msg);
+    else if (conn->num_pending_sends < MAX_PENDING_SENDS)
+        conn->pending_sends[conn->num_pending_sends++] = *conn->send_msg;
+    else
+        die("send_message: too many sends before the connection was established.");
+    pthread_mutex_unlock(&conn->state_lock);
+}
+
 void send_read_finish(struct connection_client *conn)
 {
-    memset(conn->send_msg, 0, sizeof(struct message));
+    conn->send_msg->version = MSG_VERSION;
     conn->send_msg->type = MSG_DONE;
+    conn->send_msg->seq++;
     send_message(conn);
 }
 
@@ -384,6 +441,13 @@ void post_rdma_read_client(struct connection_client *conn)
     TEST_NZ(ibv_post_send(conn->qp, &wr, &bad_wr));
 }
 
+void set_server_mr(struct connection_client *conn, const struct message *msg)
+{
+    conn->server_mr.addr = (void *)(uintptr_t)msg->addr;
+    conn->server_mr.rkey = msg->rkey;
+    conn->server_mr.length = msg->length;
+}
+
 void on_completion_client(struct ibv_wc *wc)
 {
     struct connection_client *conn = (struct connection_client *)(uintptr_t)wc->wr_id;
@@ -393,41 +457,67 @@ void on_completion_client(struct ibv_wc *wc)
 
     if (wc->opcode & IBV_WC_RECV)
     {
+        if (conn->recv_msg->version != MSG_VERSION)
+            die("on_completion: unknown message version.");
+
         printf("recv success\n");
         
         if (conn->recv_msg->type == MSG_MR)
-        {
-            memcpy(&conn->server_mr, &conn->recv_msg->data.mr, sizeof(conn->server_mr));
-        }
+            set_server_mr(conn, conn->recv_msg);
         start = get_cycles();   
         post_rdma_read_client(conn);
     }
     else
     {
-        for(int i = 0; i < max_prime; i++) {
-            point = conn->rdma_local_region + rand_offset[i];
-        }
-        
+        end = get_cycles();
+
         FILE *fp;
         TEST_Z(fp = fopen("./data-cas-random", "a"));
 
-        end = get_cycles();
         cycles_to_units = get_cpu_mhz(0) * 1000000;
         sum_of_test_cycles = (double)(end - start);
+        /* the whole buffer lands with this one read, so it is also the first byte */
+        printf("connect to first byte : %lf us\n", (end - connect_start) * 1000000 / cycles_to_units);
         double tp_avg = ((double) RDMA_BUFFER_SIZE * cycles_to_units) / (sum_of_test_cycles * 0x100000);
         //double bw_avg = ((double) RDMA_BUFFER_SIZE * cycles_to_units) / (sum_of_test_cycles * 0x100000);
         //printf("\nsum_of_test_cycles : %lf\n", sum_of_test_cycles);
         //printf("\ncpu time : %lf s, cpu frequency : %lf hz\n bandwidth : %lf MB/s, throughput : %lf MB/s\n", sum_of_test_cycles/cycles_to_units, cycles_to_units, bw_avg, tp_avg);
         fprintf(fp, "%lu cputime(s) %lf throughput(MB/s) %lf\n", RDMA_BLOCK_SIZE, sum_of_test_cycles/cycles_to_units, tp_avg);
         fclose(fp);
+        print_cq_batch_hist();
         rdma_disconnect(conn->id);
     }
 }
 
+/* bucket i counts polls that drained [2^i, 2^(i+1)) completions at once */
+void record_cq_batch(int n)
+{
+    int i = 0;
+
+    while (n >>= 1)
+        i++;
+    if (i >= CQ_BATCH_HIST_SIZE)
+        i = CQ_BATCH_HIST_SIZE - 1;
+    cq_batch_hist[i]++;
+}
+
+void print_cq_batch_hist(void)
+{
+    printf("cq poll batch histogram (batch %d):\n", CQ_POLL_BATCH);
+    for (int i = 0; i < CQ_BATCH_HIST_SIZE; i++)
+    {
+        if (cq_batch_hist[i])
+            printf("  %5d - %5d : %lu\n", 1 << i, (1 << (i + 1)) - 1, cq_batch_hist[i]);
+    }
+}
+
 void *poll_cq(void *context)
 {
     struct ibv_cq *cq;
-    struct ibv_wc wc;
+    struct ibv_wc *wc;
+    int n;
+
+    TEST_Z(wc = calloc(CQ_POLL_BATCH, sizeof(struct ibv_wc)));
 
     while (1)
     {
@@ -435,8 +525,14 @@ void *poll_cq(void *context)
         ibv_ack_cq_events(cq, 1);
         TEST_NZ(ibv_req_notify_cq(cq, 0));
 
-        while (ibv_poll_cq(cq, 1, &wc))
-            on_completion_client(&wc);
+        while ((n = ibv_poll_cq(cq, CQ_POLL_BATCH, wc)) != 0)
+        {
+            if (n < 0)
+                die("poll_cq: ibv_poll_cq failed.");
+            record_cq_batch(n);
+            for (int i = 0; i < n; i++)
+                on_completion_client(&wc[i]);
+        }
     }
 
     return NULL;
@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "block_dir.h"
+#include "get_clock.h"
+
+#define TEST_NZ(x) do { if ( (x)) die("error: " #x " failed (returned non-zero)." ); } while (0)
+#define TEST_Z(x)  do { if (!(x)) die("error: " #x " failed (returned zero/null)."); } while (0)
+
+static void die(const char *reason);
+static uint64_t next_random(uint64_t *state);
+static void run(const char *name, struct block_dir *d, uint64_t *keys, unsigned long num_keys, unsigned long lookups);
+
+int main(int argc, char **argv)
+{
+    unsigned long num_blocks = 1 << 20;
+    unsigned long lookups = 1 << 24;
+    uint64_t state = 88172645463325252ULL;
+    struct block_dir dense, hash;
+    uint64_t *ids, *keys, *absent;
+    char *data;
+
+    if (argc > 1)
+        TEST_Z(num_blocks = strtoul(argv[1], NULL, 0));
+    if (argc > 2)
+        TEST_Z(lookups = strtoul(argv[2], NULL, 0));
+    if (argc > 3) {
+        fprintf(stderr, "usage: %s [num-blocks] [lookups]\n", argv[0]);
+        return 1;
+    }
+
+    TEST_Z(ids = malloc(num_blocks * sizeof(uint64_t)));
+    TEST_Z(keys = malloc(num_blocks * sizeof(uint64_t)));
+    TEST_Z(absent = malloc(num_blocks * sizeof(uint64_t)));
+    TEST_Z(data = malloc(num_blocks));
+
+    TEST_NZ(block_dir_init(&dense, BLOCK_DIR_DENSE, num_blocks));
+    TEST_NZ(block_dir_init(&hash, BLOCK_DIR_HASH, num_blocks));
+
+    /* one byte blocks: only the lookups are timed */
+    for (unsigned long i = 0; i < num_blocks; i++) {
+        ids[i] = i;
+        TEST_NZ(block_dir_insert(&dense, i, data + i, 1));
+
+        do {
+            keys[i] = next_random(&state);
+        } while (block_dir_find(&hash, keys[i]));
+        TEST_NZ(block_dir_insert(&hash, keys[i], data + i, 1));
+    }
+    for (unsigned long i = 0; i < num_blocks; i++) {
+        do {
+            absent[i] = next_random(&state);
+        } while (block_dir_find(&hash, absent[i]));
+    }
+
+    printf("%lu blocks, %lu lookups in random order\n", num_blocks, lookups);
+    run("dense ids", &dense, ids, num_blocks, lookups);
+    run("hash, hits", &hash, keys, num_blocks, lookups);
+    run("hash, misses", &hash, absent, num_blocks, lookups);
+
+    block_dir_free(&dense);
+    block_dir_free(&hash);
+    free(ids);
+    free(keys);
+    free(absent);
+    free(data);
+
+    return 0;
+}
+
+void die(const char *reason)
+{
+    fprintf(stderr, "%s\n", reason);
+    exit(EXIT_FAILURE);
+}
+
+/* xorshift64* */
+uint64_t next_random(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+/* the key order is drawn up front, so the loop times the directory and not the generator */
+void run(const char *name, struct block_dir *d, uint64_t *keys, unsigned long num_keys, unsigned long lookups)
+{
+    uint64_t state = 0x2545F4914F6CDD1DULL;
+    uint32_t *order;
+    unsigned long found = 0;
+    cycles_t t;
+
+    TEST_Z(order = malloc(lookups * sizeof(uint32_t)));
+    for (unsigned long i = 0; i < lookups; i++)
+        order[i] = next_random(&state) % num_keys;
+
+    t = get_cycles();
+    for (unsigned long i = 0; i < lookups; i++) {
+        if (block_dir_find(d, keys[order[i]]))
+            found++;
+    }
+    t = get_cycles() - t;
+
+    double seconds = t / (get_cpu_mhz(0) * 1000000);
+    printf("%-14s : %lf M lookups/s, %lf ns per lookup, %lu found\n",
+        name, lookups / seconds / 1000000, seconds * 1e9 / lookups, found);
+
+    free(order);
+}
@@ -0,0 +1,128 @@
+#include <stdlib.h>
+#include <string.h>
+#include "block_dir.h"
+
+const char *block_dir_names[] = { "dense", "hash" };
+
+/* fibonacci hashing: the high bits of the product mix every bit of the key */
+static size_t hash_slot(struct block_dir *d, uint64_t key)
+{
+    return (key * 0x9E3779B97F4A7C15ULL) >> d->shift;
+}
+
+static int alloc_slots(struct block_dir *d, size_t slots)
+{
+    int bits = 0;
+
+    while (((size_t)1 << bits) < slots)
+        bits++;
+    if (!(d->entries = calloc((size_t)1 << bits, sizeof(struct block_dir_entry))))
+        return -1;
+    d->capacity = (size_t)1 << bits;
+    d->shift = 64 - bits;
+    return 0;
+}
+
+static struct block_dir_entry *probe(struct block_dir *d, uint64_t key)
+{
+    size_t mask = d->capacity - 1;
+    size_t i = hash_slot(d, key);
+
+    while (d->entries[i].addr && d->entries[i].key != key)
+        i = (i + 1) & mask;
+    return &d->entries[i];
+}
+
+static int grow(struct block_dir *d)
+{
+    struct block_dir_entry *old = d->entries;
+    size_t old_capacity = d->capacity;
+
+    if (alloc_slots(d, 2 * old_capacity))
+    {
+        d->entries = old;
+        d->capacity = old_capacity;
+        return -1;
+    }
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        if (old[i].addr)
+            *probe(d, old[i].key) = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+int block_dir_parse_kind(const char *name, enum block_dir_kind *kind)
+{
+    for (int i = 0; i < sizeof(block_dir_names) / sizeof(block_dir_names[0]); i++)
+    {
+        if (strcmp(name, block_dir_names[i]) == 0)
+        {
+            *kind = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int block_dir_init(struct block_dir *d, enum block_dir_kind kind, size_t size)
+{
+    memset(d, 0, sizeof(*d));
+    d->kind = kind;
+
+    if (kind == BLOCK_DIR_HASH)
+        return alloc_slots(d, 2 * (size ? size : 1));
+
+    if (!(d->entries = calloc(size ? size : 1, sizeof(struct block_dir_entry))))
+        return -1;
+    d->capacity = size;
+    return 0;
+}
+
+void block_dir_free(struct block_dir *d)
+{
+    free(d->entries);
+    memset(d, 0, sizeof(*d));
+}
+
+int block_dir_insert(struct block_dir *d, uint64_t key, char *addr, size_t length)
+{
+    struct block_dir_entry *e;
+
+    if (!addr)
+        return -1;
+
+    if (d->kind == BLOCK_DIR_DENSE)
+    {
+        if (key >= d->capacity)
+            return -1;
+        e = &d->entries[key];
+    }
+    else
+    {
+        /* keep the table at most half full, so probe runs stay short */
+        if (2 * (d->count + 1) > d->capacity && grow(d))
+            return -1;
+        e = probe(d, key);
+    }
+
+    if (!e->addr)
+        d->count++;
+    e->key = key;
+    e->addr = addr;
+    e->length = length;
+    return 0;
+}
+
+struct block_dir_entry *block_dir_find(struct block_dir *d, uint64_t key)
+{
+    struct block_dir_entry *e;
+
+    if (d->kind == BLOCK_DIR_DENSE)
+        e = key < d->capacity ? &d->entries[key] : NULL;
+    else
+        e = probe(d, key);
+
+    return e && e->addr ? e : NULL;
+}
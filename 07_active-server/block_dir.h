@@ -0,0 +1,49 @@
+#ifndef BLOCK_DIR_H
+#define BLOCK_DIR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Maps block ids to where the block lives. Dense ids 0..n-1 index the entry
+ * array directly. Sparse 64-bit keys go into an open-addressing table with
+ * linear probing, kept at most half full, so a lookup is usually one cache
+ * line. Entries carry their own length, so blocks need not all be the same
+ * size.
+ */
+enum block_dir_kind
+{
+    BLOCK_DIR_DENSE,
+    BLOCK_DIR_HASH
+};
+
+struct block_dir_entry
+{
+    uint64_t key;
+    char *addr;                 /* NULL marks an empty slot */
+    size_t length;
+};
+
+struct block_dir
+{
+    enum block_dir_kind kind;
+    struct block_dir_entry *entries;
+    size_t capacity;            /* ids for dense, slots (a power of two) for hash */
+    size_t count;
+    int shift;                  /* hash: 64 - log2(capacity) */
+};
+
+extern const char *block_dir_names[];
+
+/* "dense" or "hash" */
+int block_dir_parse_kind(const char *name, enum block_dir_kind *kind);
+
+/* size is the number of ids for dense, the expected number of keys for hash */
+int block_dir_init(struct block_dir *d, enum block_dir_kind kind, size_t size);
+void block_dir_free(struct block_dir *d);
+
+/* replaces an existing entry for key; dense keys must be below the size given to init */
+int block_dir_insert(struct block_dir *d, uint64_t key, char *addr, size_t length);
+struct block_dir_entry *block_dir_find(struct block_dir *d, uint64_t key);
+
+#endif
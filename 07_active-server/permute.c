@@ -0,0 +1,50 @@
+#include "permute.h"
+
+/* splitmix64: spreads the seed into independent round keys */
+static uint64_t mix64(uint64_t x)
+{
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+void permute_init(struct permute *p, uint64_t n, uint64_t seed)
+{
+    p->n = n;
+    p->half_bits = 1;
+    while (p->half_bits < 32 && ((uint64_t)1 << (2 * p->half_bits)) < n)
+        p->half_bits++;
+    p->half_mask = ((uint64_t)1 << p->half_bits) - 1;
+
+    for (int i = 0; i < PERMUTE_ROUNDS; i++)
+        p->keys[i] = mix64(seed + i);
+}
+
+static uint64_t feistel(const struct permute *p, uint64_t x)
+{
+    uint64_t left = x >> p->half_bits, right = x & p->half_mask;
+
+    for (int i = 0; i < PERMUTE_ROUNDS; i++)
+    {
+        uint64_t f = (right ^ p->keys[i]) * 0xD6E8FEB86659FD93ULL;
+        uint64_t next = left ^ ((f ^ (f >> 32)) & p->half_mask);
+
+        left = right;
+        right = next;
+    }
+    return (left << p->half_bits) | right;
+}
+
+uint64_t permute_at(const struct permute *p, uint64_t i)
+{
+    if (p->n <= 1)
+        return i;
+
+    /* the feistel network is a bijection on the whole domain, so walking stays inside [0, n) */
+    do
+    {
+        i = feistel(p, i);
+    } while (i >= p->n);
+    return i;
+}
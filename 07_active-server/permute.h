@@ -0,0 +1,25 @@
+#ifndef PERMUTE_H
+#define PERMUTE_H
+
+#include <stdint.h>
+
+/*
+ * Seeded bijection on [0, n), computed one element at a time in constant
+ * memory. A four round Feistel network permutes the smallest power-of-four
+ * domain that holds n; results that fall outside [0, n) are fed through
+ * again (cycle walking), which takes fewer than four passes on average.
+ */
+#define PERMUTE_ROUNDS 4
+
+struct permute
+{
+    uint64_t n;
+    int half_bits;
+    uint64_t half_mask;
+    uint64_t keys[PERMUTE_ROUNDS];
+};
+
+void permute_init(struct permute *p, uint64_t n, uint64_t seed);
+uint64_t permute_at(const struct permute *p, uint64_t i);
+
+#endif
@@ -3,8 +3,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
 #include <rdma/rdma_cma.h>
 #include "get_clock.h"
+#include "region.h"
 
 #define TEST_NZ(x) do { if ( (x)) die("error: " #x " failed (returned non-zero)." ); } while (0)
 #define TEST_Z(x)  do { if (!(x)) die("error: " #x " failed (returned zero/null)."); } while (0)
@@ -13,9 +16,16 @@ static const int RDMA_BUFFER_SIZE = 1 * 1024 * 1024;
 static const int DATA_BUFFER_SIZE = RDMA_BUFFER_SIZE;
 static int RDMA_BLOCK_SIZE;
 const int TIMEOUT_IN_MS = 500;
+/* block requests kept in flight */
+int RDMA_WINDOW = 8;
+/* blocks asked for per request; more than one goes out as a single MSG_READ_RANGE */
+int RDMA_BATCH = 1;
+/* every block is written straight to its place in app_data, which should end up as the server's copy */
 char *app_data;
+struct region app_region;
 
 cycles_t start, end;
+double cpu_start;
 
 /*
     set RDMA_BLOCK_SIZE:
@@ -41,18 +51,29 @@ enum mode {
 };
 
 /* design message */
-struct message {
-    enum {
-        MSG_READ_DATA,
-        MSG_RDMA_WRITE_FINISH,
-        MSG_READ_DONE
-    } type;
-
-    union {
-        struct ibv_mr mr;
-        unsigned long index;
-    } data;
+enum {
+    MSG_READ_DATA,
+    MSG_RDMA_WRITE_FINISH,
+    MSG_READ_DONE,
+    MSG_READ_RANGE
 };
+
+#define MSG_VERSION 1
+#define MAX_PENDING_SENDS 4
+#define MAX_WINDOW 64
+#define MAX_RANGE 64
+
+/* control message as it goes on the wire: fixed width, packed and small enough to send inline */
+struct message {
+    uint8_t version;
+    uint8_t type;
+    uint16_t reserved;
+    uint32_t rkey;
+    uint64_t addr;
+    uint32_t length;
+    uint32_t seq;
+    uint64_t index;
+} __attribute__((packed));
 /* end */
 
 struct context {
@@ -63,6 +84,13 @@ struct context {
     /* initialize index */
     unsigned long index;
     /* end */
+    unsigned long completed;
+    unsigned long num_blocks;
+    unsigned long requests;
+    /* requests the server reported with a MSG_RDMA_WRITE_FINISH rather than a write immediate */
+    unsigned long finish_msgs;
+    /* the cm thread opens the window while the poller may already be refilling it */
+    pthread_mutex_t window_lock;
 
     pthread_t cq_poller_thread;
 };
@@ -71,20 +99,33 @@ struct connection {
     struct rdma_cm_id *id;
     struct ibv_qp *qp;
 
-    int connected;
+    /* control sends made before ESTABLISHED wait in pending_sends until on_connect posts them */
+    enum {
+        CONN_CONNECTING,
+        CONN_ESTABLISHED
+    } state;
+    pthread_mutex_t state_lock;
+    struct message *pending_sends;
+    int num_pending_sends;
+    double setup_cpu_us;
 
     struct ibv_mr *recv_mr;
     struct ibv_mr *send_mr;
     struct ibv_mr *rdma_local_mr;
-    struct ibv_mr *rdma_remote_mr;
+    struct ibv_mr *app_mr;
 
     struct ibv_mr peer_mr;
 
+    /* RDMA_WINDOW receive buffers, consumed in the order they were posted */
     struct message *recv_msg;
+    int recv_head;
     struct message *send_msg;
+    uint32_t expected_seq;
+    /* block count of each request in the window, for finishes that only carry the seq */
+    int *slot_count;
 
+    struct region local_region;
     char *rdma_local_region;
-    char *rdma_remote_region;
 
     enum {
         SS_INIT,
@@ -109,23 +150,46 @@ static int on_addr_resolved(struct rdma_cm_id *id);
 static void build_connection(struct rdma_cm_id *id);
 static void build_context(struct ibv_context *verbs);
 static void * poll_cq(void *ctx);
+static void record_cq_batch(int n);
+static void print_cq_batch_hist(void);
+static int set_poll_mode(const char *name);
+static double cpu_seconds(void);
+static double thread_cpu_us(void);
 static void build_qp_attr(struct ibv_qp_init_attr *qp_attr);
 static void register_memory(struct connection *conn);
-static void post_receives(struct connection *conn);
+static void post_receive(struct connection *conn, int i);
 
 static int on_route_resolved(struct rdma_cm_id *id);
 static void build_params(struct rdma_conn_param *params);
 
 static int on_connection(struct rdma_cm_id *id);
 static void on_connect(void *context);
-static void send_mr_read_data(void *context, unsigned long index);
+static unsigned long send_mr_read_data(void *context, unsigned long index);
 static void send_message(struct connection *conn);
+static void post_message(struct connection *conn, struct message *msg);
 
 static int on_disconnect(struct rdma_cm_id *id);
 static void destroy_connection(void *context);
 
 static void on_completion(struct ibv_wc *wc);
 static void send_mr_read_done(void *context);
+static void on_block_finish(struct connection *conn, uint32_t seq);
+static void verify_app_data(void);
+
+#define CQ_BATCH_HIST_SIZE 16
+
+int CQ_POLL_BATCH = 16;
+unsigned long cq_batch_hist[CQ_BATCH_HIST_SIZE];
+
+enum poll_mode {
+    POLL_EVENT,
+    POLL_BUSY,
+    POLL_HYBRID
+};
+
+static const char *poll_mode_names[] = { "event", "busy", "hybrid" };
+enum poll_mode CQ_POLL_MODE = POLL_EVENT;
+int CQ_SPIN_US = 50;
 
 static struct context *s_ctx = NULL;
 static enum mode s_mode = M_WRITE;
@@ -136,16 +200,58 @@ int main(int argc, char **argv)
     struct rdma_cm_event *event = NULL;
     struct rdma_cm_id *conn= NULL;
     struct rdma_event_channel *ec = NULL;
+    int op;
+
+    while ((op = getopt(argc, argv, "c:P:u:H:O:N:F:w:b:")) != -1) {
+        switch (op) {
+        case 'c':
+            TEST_Z(CQ_POLL_BATCH = atoi(optarg));
+            break;
+        case 'P':
+            if (set_poll_mode(optarg))
+                usage(argv[0]);
+            break;
+        case 'u':
+            CQ_SPIN_US = atoi(optarg);
+            break;
+        case 'H':
+            if (region_set_backend(optarg))
+                usage(argv[0]);
+            break;
+        case 'O':
+            if (region_set_reg_mode(optarg))
+                usage(argv[0]);
+            break;
+        case 'N':
+            if (region_set_numa(optarg))
+                usage(argv[0]);
+            break;
+        case 'F':
+            REGION_FILL_THREADS = atoi(optarg);
+            break;
+        case 'w':
+            TEST_Z(RDMA_WINDOW = atoi(optarg));
+            break;
+        case 'b':
+            TEST_Z(RDMA_BATCH = atoi(optarg));
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
 
-    if (argc != 5)
+    if (argc - optind != 4)
         usage(argv[0]);
+    /* argv[0] is about to be an operand; usage still wants the program name */
+    char *prog = argv[0];
+    argv += optind - 1;
 
     if (strcmp(argv[1], "write") == 0)
         set_mode(M_WRITE);
     else if (strcmp(argv[1], "read") == 0)
         set_mode(M_READ);
     else
-        usage(argv[0]);
+        usage(prog);
 
     TEST_NZ(getaddrinfo(argv[2], argv[3], NULL, &addr));
 
@@ -153,6 +259,15 @@ int main(int argc, char **argv)
     TEST_Z(RDMA_BLOCK_SIZE = atoi(argv[4]));
     /* end */
 
+    /* the slots of the window have to fit in the remote region, and the server keeps as many */
+    if (RDMA_WINDOW > MAX_WINDOW)
+        RDMA_WINDOW = MAX_WINDOW;
+    if (RDMA_WINDOW > RDMA_BUFFER_SIZE / RDMA_BLOCK_SIZE)
+        RDMA_WINDOW = RDMA_BUFFER_SIZE / RDMA_BLOCK_SIZE;
+    TEST_Z(RDMA_WINDOW);
+    if (RDMA_BATCH > MAX_RANGE)
+        RDMA_BATCH = MAX_RANGE;
+
     TEST_Z(ec = rdma_create_event_channel());
     TEST_NZ(rdma_create_id(ec, &conn, NULL, RDMA_PS_TCP));
     TEST_NZ(rdma_resolve_addr(conn, NULL, addr->ai_addr, TIMEOUT_IN_MS));
@@ -176,7 +291,7 @@ int main(int argc, char **argv)
 
 void usage(const char *argv0)
 {
-    fprintf(stderr, "usage: %s <mode> <server-address> <server-port> <block-size>\n  mode = \"read\", \"write\"\n", argv0);
+    fprintf(stderr, "usage: %s [-c cq-poll-batch] [-P poll-mode] [-u spin-us] [-H pages] [-O reg] [-N numa-node] [-F fill-threads] [-w window] [-b blocks] <mode> <server-address> <server-port> <block-size>\n  mode = \"read\", \"write\"\n  poll-mode = \"event\", \"busy\", \"hybrid\"\n  pages = \"malloc\", \"2m\", \"1g\" or a hugetlbfs mount\n  reg = \"pinned\", \"odp\", \"implicit\"\n  numa-node = node number or \"off\", default is the node of the device\n  fill-threads = threads that first touch the buffers, default one per cpu of the node\n  window = block requests kept in flight, default 8\n  blocks = blocks per request, up to 64, default 1\n", argv0);
     exit(1);
 }
 
@@ -194,6 +309,7 @@ void die(const char *reason)
 int on_event(struct rdma_cm_event *event)
 {
     int r = 0;
+    double cpu = thread_cpu_us();
 
     if (event->event == RDMA_CM_EVENT_ADDR_RESOLVED)
         r = on_addr_resolved(event->id);
@@ -208,6 +324,15 @@ int on_event(struct rdma_cm_event *event)
         die("on_event: unknown event.");
     }
 
+    /* what the cm thread spends on a connection until it is established is its setup cost */
+    if (event->event == RDMA_CM_EVENT_ADDR_RESOLVED || event->event == RDMA_CM_EVENT_ROUTE_RESOLVED || event->event == RDMA_CM_EVENT_ESTABLISHED) {
+        struct connection *conn = (struct connection *)event->id->context;
+
+        conn->setup_cpu_us += thread_cpu_us() - cpu;
+        if (event->event == RDMA_CM_EVENT_ESTABLISHED)
+            printf("connection set up with %lf us of cpu.\n", conn->setup_cpu_us);
+    }
+
     return r;
 }
 
@@ -239,7 +364,11 @@ void build_connection(struct rdma_cm_id *id)
     conn->send_state = SS_INIT;
     conn->recv_state = RS_INIT;
 
-    conn->connected = 0;
+    conn->state = CONN_CONNECTING;
+    TEST_NZ(pthread_mutex_init(&conn->state_lock, NULL));
+    TEST_Z(conn->pending_sends = calloc(MAX_PENDING_SENDS, sizeof(struct message)));
+    conn->num_pending_sends = 0;
+    conn->setup_cpu_us = 0;
 
     register_memory(conn);
 }
@@ -256,31 +385,123 @@ void build_context(struct ibv_context *verbs)
     s_ctx = (struct context *)malloc(sizeof(struct context));
 
     s_ctx->ctx = verbs;
+    region_place(s_ctx->ctx);
+    region_report_placement();
 
     /* initialize index */
     s_ctx->index = 0;
     /* end */
+    s_ctx->completed = 0;
+    s_ctx->requests = 0;
+    s_ctx->finish_msgs = 0;
+    s_ctx->num_blocks = DATA_BUFFER_SIZE / RDMA_BLOCK_SIZE;
+    TEST_NZ(pthread_mutex_init(&s_ctx->window_lock, NULL));
 
     TEST_Z(s_ctx->pd = ibv_alloc_pd(s_ctx->ctx));
     TEST_Z(s_ctx->comp_channel = ibv_create_comp_channel(s_ctx->ctx));
-    TEST_Z(s_ctx->cq = ibv_create_cq(s_ctx->ctx, 10, NULL, s_ctx->comp_channel, 0)); /* cqe=10 is arbitrary */
-    TEST_NZ(ibv_req_notify_cq(s_ctx->cq, 0));
+    TEST_Z(s_ctx->cq = ibv_create_cq(s_ctx->ctx, 4 * RDMA_WINDOW + 2, NULL, s_ctx->comp_channel, 0)); /* a send and a receive per slot, with room to spare */
 
     TEST_NZ(pthread_create(&s_ctx->cq_poller_thread, NULL, poll_cq, NULL));
+    if (region_pin_thread(s_ctx->cq_poller_thread) == 0)
+        printf("cq poller pinned to the placement node\n");
+}
+
+/* bucket i counts polls that drained [2^i, 2^(i+1)) completions at once */
+void record_cq_batch(int n)
+{
+    int i = 0;
+
+    while (n >>= 1)
+        i++;
+    if (i >= CQ_BATCH_HIST_SIZE)
+        i = CQ_BATCH_HIST_SIZE - 1;
+    cq_batch_hist[i]++;
 }
 
+void print_cq_batch_hist(void)
+{
+    printf("cq poll batch histogram (batch %d):\n", CQ_POLL_BATCH);
+    for (int i = 0; i < CQ_BATCH_HIST_SIZE; i++) {
+        if (cq_batch_hist[i])
+            printf("  %5d - %5d : %lu\n", 1 << i, (1 << (i + 1)) - 1, cq_batch_hist[i]);
+    }
+}
+
+int set_poll_mode(const char *name)
+{
+    for (int i = 0; i < sizeof(poll_mode_names) / sizeof(poll_mode_names[0]); i++) {
+        if (strcmp(name, poll_mode_names[i]) == 0) {
+            CQ_POLL_MODE = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* user + system time of the whole process, so it covers the poller thread too */
+double cpu_seconds(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+double thread_cpu_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+/*
+ * POLL_EVENT  : sleep on the completion channel whenever the cq is empty
+ * POLL_BUSY   : never arm the cq, spin on ibv_poll_cq
+ * POLL_HYBRID : spin for CQ_SPIN_US after the last completion, then arm and sleep
+ */
 void * poll_cq(void *ctx)
 {
-    struct ibv_cq *cq;
-    struct ibv_wc wc;
+    struct ibv_cq *cq = s_ctx->cq;
+    struct ibv_wc *wc;
+    cycles_t idle_start = get_cycles();
+    cycles_t spin_cycles = 0;
+    int armed = 0;
+    int n;
+
+    TEST_Z(wc = calloc(CQ_POLL_BATCH, sizeof(struct ibv_wc)));
+    if (CQ_POLL_MODE == POLL_HYBRID)
+        spin_cycles = get_cpu_mhz(0) * CQ_SPIN_US;
 
     while (1) {
+        if ((n = ibv_poll_cq(cq, CQ_POLL_BATCH, wc)) < 0)
+            die("poll_cq: ibv_poll_cq failed.");
+
+        if (n > 0) {
+            record_cq_batch(n);
+            for (int i = 0; i < n; i++)
+                on_completion(&wc[i]);
+            idle_start = get_cycles();
+            armed = 0;
+            continue;
+        }
+
+        if (CQ_POLL_MODE == POLL_BUSY)
+            continue;
+        if (CQ_POLL_MODE == POLL_HYBRID && get_cycles() - idle_start < spin_cycles)
+            continue;
+
+        /* arm, then poll once more so a completion racing the arm is not slept through */
+        if (!armed) {
+            TEST_NZ(ibv_req_notify_cq(cq, 0));
+            armed = 1;
+            continue;
+        }
+
         TEST_NZ(ibv_get_cq_event(s_ctx->comp_channel, &cq, &ctx));
         ibv_ack_cq_events(cq, 1);
-        TEST_NZ(ibv_req_notify_cq(cq, 0));
-
-        while (ibv_poll_cq(cq, 1, &wc))
-            on_completion(&wc);
+        idle_start = get_cycles();
+        armed = 0;
     }
 
     return NULL;
@@ -294,24 +515,27 @@ void build_qp_attr(struct ibv_qp_init_attr *qp_attr)
     qp_attr->recv_cq = s_ctx->cq;
     qp_attr->qp_type = IBV_QPT_RC;
 
-    qp_attr->cap.max_send_wr = 10;
-    qp_attr->cap.max_recv_wr = 10;
+    qp_attr->cap.max_send_wr = 2 * RDMA_WINDOW + 1;
+    qp_attr->cap.max_recv_wr = RDMA_WINDOW;
     qp_attr->cap.max_send_sge = 1;
     qp_attr->cap.max_recv_sge = 1;
+    qp_attr->cap.max_inline_data = sizeof(struct message);
 }
 
 void register_memory(struct connection *conn)
 {
     /* build app data */
-    app_data = malloc(DATA_BUFFER_SIZE);
-    memset(app_data, 0, DATA_BUFFER_SIZE);
+    TEST_Z(app_data = region_alloc(&app_region, DATA_BUFFER_SIZE));
+    region_fill(&app_region, DATA_BUFFER_SIZE, "", 1);
     /* end */
 
-    conn->send_msg = malloc(sizeof(struct message));
-    conn->recv_msg = malloc(sizeof(struct message));
+    conn->send_msg = calloc(1, sizeof(struct message));
+    conn->recv_msg = calloc(RDMA_WINDOW, sizeof(struct message));
+    conn->recv_head = 0;
+    conn->expected_seq = 0;
+    TEST_Z(conn->slot_count = calloc(RDMA_WINDOW, sizeof(int)));
 
-    conn->rdma_local_region = malloc(RDMA_BUFFER_SIZE);
-    conn->rdma_remote_region = malloc(RDMA_BUFFER_SIZE);
+    TEST_Z(conn->rdma_local_region = region_alloc(&conn->local_region, RDMA_BUFFER_SIZE));
 
     TEST_Z(conn->send_mr = ibv_reg_mr(
     s_ctx->pd, 
@@ -322,23 +546,28 @@ void register_memory(struct connection *conn)
     TEST_Z(conn->recv_mr = ibv_reg_mr(
     s_ctx->pd, 
     conn->recv_msg, 
-    sizeof(struct message), 
+    RDMA_WINDOW * sizeof(struct message), 
     IBV_ACCESS_LOCAL_WRITE | ((s_mode == M_WRITE) ? IBV_ACCESS_REMOTE_WRITE : IBV_ACCESS_REMOTE_READ)));
 
-    TEST_Z(conn->rdma_local_mr = ibv_reg_mr(
+    TEST_Z(conn->rdma_local_mr = region_reg_mr(
+    &conn->local_region, 
     s_ctx->pd, 
-    conn->rdma_local_region, 
-    RDMA_BUFFER_SIZE, 
     IBV_ACCESS_LOCAL_WRITE));
 
-    TEST_Z(conn->rdma_remote_mr = ibv_reg_mr(
+    /* the server places blocks directly here, so there is nothing to copy out on completion */
+    TEST_Z(conn->app_mr = region_reg_mr(
+    &app_region, 
     s_ctx->pd, 
-    conn->rdma_remote_region, 
-    RDMA_BUFFER_SIZE, 
     IBV_ACCESS_LOCAL_WRITE | ((s_mode == M_WRITE) ? IBV_ACCESS_REMOTE_WRITE : IBV_ACCESS_REMOTE_READ)));
+
+    region_report("local region", &conn->local_region);
+    region_report("app data", &app_region);
+
+    for (int i = 0; i < RDMA_WINDOW; i++)
+        post_receive(conn, i);
 }
 
-void post_receives(struct connection *conn)
+void post_receive(struct connection *conn, int i)
 {
     struct ibv_recv_wr wr, *bad_wr = NULL;
     struct ibv_sge sge;
@@ -348,7 +577,7 @@ void post_receives(struct connection *conn)
     wr.sg_list = &sge;
     wr.num_sge = 1;
 
-    sge.addr = (uintptr_t)conn->recv_msg;
+    sge.addr = (uintptr_t)&conn->recv_msg[i];
     sge.length = sizeof(struct message);
     sge.lkey = conn->recv_mr->lkey;
 
@@ -377,29 +606,56 @@ void build_params(struct rdma_conn_param *params)
 int on_connection(struct rdma_cm_id *id)
 {
     on_connect(id->context);
+    cpu_start = cpu_seconds();
     start = get_cycles();
-    send_mr_read_data(id->context, s_ctx->index);
+    /* open the window: one request per slot, the rest follow as blocks come back */
+    pthread_mutex_lock(&s_ctx->window_lock);
+    for (int i = 0; i < RDMA_WINDOW && s_ctx->index < s_ctx->num_blocks; i++)
+        s_ctx->index += send_mr_read_data(id->context, s_ctx->index);
+    pthread_mutex_unlock(&s_ctx->window_lock);
 
     return 0;
 }
 
 void on_connect(void *context)
 {
-    ((struct connection *)context)->connected = 1;
+    struct connection *conn = (struct connection *)context;
+
+    pthread_mutex_lock(&conn->state_lock);
+    conn->state = CONN_ESTABLISHED;
+    for (int i = 0; i < conn->num_pending_sends; i++)
+        post_message(conn, &conn->pending_sends[i]);
+    conn->num_pending_sends = 0;
+    pthread_mutex_unlock(&conn->state_lock);
 }
 
-void send_mr_read_data(void *context, unsigned long index)
+/* asks for up to RDMA_BATCH blocks from index on, in one round trip; returns how many */
+unsigned long send_mr_read_data(void *context, unsigned long index)
 {
     struct connection *conn = (struct connection *)context;
-
-    conn->send_msg->type = MSG_READ_DATA;
-
-    memcpy(&conn->send_msg->data.mr, conn->rdma_remote_mr, sizeof(struct ibv_mr));
-    conn->send_msg->data.index = s_ctx->index;
+    unsigned long count = s_ctx->num_blocks - index;
+
+    if (count > RDMA_BATCH)
+        count = RDMA_BATCH;
+
+    conn->send_msg->version = MSG_VERSION;
+    conn->send_msg->type = count > 1 ? MSG_READ_RANGE : MSG_READ_DATA;
+    conn->send_msg->seq++;
+
+    /* the range's final place in app_data */
+    conn->send_msg->addr = (uintptr_t)(app_data + index * RDMA_BLOCK_SIZE);
+    conn->send_msg->rkey = conn->app_mr->rkey;
+    conn->send_msg->length = count * RDMA_BLOCK_SIZE;
+    conn->send_msg->index = index;
+    conn->slot_count[conn->send_msg->seq % RDMA_WINDOW] = count;
+    s_ctx->requests++;
     send_message(conn);
+
+    return count;
 }
 
-void send_message(struct connection *conn)
+/* control messages go inline, so msg does not have to be registered */
+void post_message(struct connection *conn, struct message *msg)
 {
     struct ibv_send_wr wr, *bad_wr = NULL;
     struct ibv_sge sge;
@@ -410,17 +666,25 @@ void send_message(struct connection *conn)
     wr.opcode = IBV_WR_SEND;
     wr.sg_list = &sge;
     wr.num_sge = 1;
-    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.send_flags = IBV_SEND_SIGNALED | IBV_SEND_INLINE;
 
-    sge.addr = (uintptr_t)conn->send_msg;
+    sge.addr = (uintptr_t)msg;
     sge.length = sizeof(struct message);
     sge.lkey = conn->send_mr->lkey;
 
-    while (!conn->connected);
-
     TEST_NZ(ibv_post_send(conn->qp, &wr, &bad_wr));
+}
 
-    conn->send_state = SS_MR_SENT;
+void send_message(struct connection *conn)
+{
+    pthread_mutex_lock(&conn->state_lock);
+    if (conn->state == CONN_ESTABLISHED)
+        post_message(conn, conn->send_msg);
+    else if (conn->num_pending_sends < MAX_PENDING_SENDS)
+        conn->pending_sends[conn->num_pending_sends++] = *conn->send_msg;
+    else
+        die("send_message: too many sends before the connection was established.");
+    pthread_mutex_unlock(&conn->state_lock);
 }
 
 int on_disconnect(struct rdma_cm_id *id)
@@ -439,16 +703,19 @@ void destroy_connection(void *context)
 
     ibv_dereg_mr(conn->send_mr);
     ibv_dereg_mr(conn->recv_mr);
-    ibv_dereg_mr(conn->rdma_local_mr);
-    ibv_dereg_mr(conn->rdma_remote_mr);
+    region_dereg_mr(&conn->local_region, conn->rdma_local_mr);
+    region_dereg_mr(&app_region, conn->app_mr);
 
     free(conn->send_msg);
     free(conn->recv_msg);
-    free(conn->rdma_local_region);
-    free(conn->rdma_remote_region);
+    region_free(&conn->local_region);
+    region_free(&app_region);
 
     rdma_destroy_id(conn->id);
 
+    free(conn->pending_sends);
+    free(conn->slot_count);
+    pthread_mutex_destroy(&conn->state_lock);
     free(conn);
 }
 
@@ -460,28 +727,58 @@ void on_completion(struct ibv_wc *wc)
         die("on_completion: status is not IBV_WC_SUCCESS.");
 
     if (wc->opcode & IBV_WC_RECV) {
-        if (conn->recv_msg->type == MSG_RDMA_WRITE_FINISH) {
-            memcpy(app_data, conn->rdma_remote_region, RDMA_BLOCK_SIZE);
-            printf("index : %lu \n", s_ctx->index);
-        
-            s_ctx->index++;
-            if (s_ctx->index == DATA_BUFFER_SIZE / RDMA_BLOCK_SIZE) {
-		        end = get_cycles();
-                double total_cycles = (double)(end - start);
-                double cycles_to_units = get_cpu_mhz(0) * 1000000;
-                double bw_avg = ((double) (RDMA_BUFFER_SIZE + 2 * (s_ctx->index + 1) * sizeof(struct message)) * cycles_to_units) / (total_cycles * 0x100000);
-                double tp_avg = ((double) RDMA_BUFFER_SIZE * cycles_to_units) / (total_cycles * 0x100000);
-		        printf("\ncpu time : %lf s, bandwidth : %lf MB/s, throughput : %lf MB/s\n", total_cycles / cycles_to_units, bw_avg, tp_avg);
-                send_mr_read_done(conn);
-            } else {
-                send_mr_read_data(conn, s_ctx->index);
-            }
+        struct message *msg = &conn->recv_msg[conn->recv_head];
+        uint32_t seq;
+
+        /* a write with immediate carries the seq of the request it answers and leaves the receive buffer alone */
+        if (wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+            seq = ntohl(wc->imm_data);
+        } else {
+            if (msg->version != MSG_VERSION)
+                die("on_completion: unknown message version.");
+            if (msg->type != MSG_RDMA_WRITE_FINISH)
+                die("on_completion: unexpected message.");
+            seq = msg->seq;
+            s_ctx->finish_msgs++;
         }
+
+        /* hand the buffer back before asking for more */
+        post_receive(conn, conn->recv_head);
+        conn->recv_head = (conn->recv_head + 1) % RDMA_WINDOW;
+
+        on_block_finish(conn, seq);
+    }
+}
+
+void on_block_finish(struct connection *conn, uint32_t seq)
+{
+    int count = conn->slot_count[seq % RDMA_WINDOW];
+
+    if (seq != ++conn->expected_seq)
+        die("on_completion: block finished out of order.");
+
+    s_ctx->completed += count;
+    if (s_ctx->completed == s_ctx->num_blocks) {
+        end = get_cycles();
+        double total_cycles = (double)(end - start);
+        double cycles_to_units = get_cpu_mhz(0) * 1000000;
+        double bw_avg = ((double) (RDMA_BUFFER_SIZE + (s_ctx->requests + 1 + s_ctx->finish_msgs) * sizeof(struct message)) * cycles_to_units) / (total_cycles * 0x100000);
+        double tp_avg = ((double) RDMA_BUFFER_SIZE * cycles_to_units) / (total_cycles * 0x100000);
+        printf("\ncpu time : %lf s, bandwidth : %lf MB/s, throughput : %lf MB/s\n", total_cycles / cycles_to_units, bw_avg, tp_avg);
+        printf("poll mode : %s, window : %d, blocks per request : %d, avg time per block : %lf us, cpu usage : %lf %%\n",
+            poll_mode_names[CQ_POLL_MODE], RDMA_WINDOW, RDMA_BATCH,
+            total_cycles / cycles_to_units * 1000000 / s_ctx->completed,
+            (cpu_seconds() - cpu_start) * 100 / (total_cycles / cycles_to_units));
+        printf("finish notices : %lu messages, %lu write immediates\n", s_ctx->finish_msgs, s_ctx->requests - s_ctx->finish_msgs);
+        print_cq_batch_hist();
+        if (s_mode == M_WRITE)
+            verify_app_data();
+        send_mr_read_done(conn);
     } else {
-        if (conn->send_state == SS_MR_SENT) {
-            post_receives(conn);
-            conn->send_state = SS_INIT;
-        }
+        pthread_mutex_lock(&s_ctx->window_lock);
+        if (s_ctx->index < s_ctx->num_blocks)
+            s_ctx->index += send_mr_read_data(conn, s_ctx->index);
+        pthread_mutex_unlock(&s_ctx->window_lock);
     }
 }
 
@@ -489,7 +786,32 @@ void send_mr_read_done(void *context)
 {
     struct connection *conn = (struct connection *)context;
 
+    conn->send_msg->version = MSG_VERSION;
     conn->send_msg->type = MSG_READ_DONE;
+    conn->send_msg->seq++;
 
     send_message(conn);
-}
\ No newline at end of file
+}
+
+/* the server fills its app data with this pattern from offset 0 */
+void verify_app_data(void)
+{
+    static const char pattern[] = "abcdefghijklmnop";
+    unsigned long bad = 0;
+
+    for (unsigned long i = 0; i < s_ctx->num_blocks; i++) {
+        char *block = app_data + i * RDMA_BLOCK_SIZE;
+
+        for (int j = 0; j < RDMA_BLOCK_SIZE; j++) {
+            if (block[j] != pattern[(i * RDMA_BLOCK_SIZE + j) % (sizeof(pattern) - 1)]) {
+                bad++;
+                break;
+            }
+        }
+    }
+
+    if (bad)
+        printf("reassembled data : %lu of %lu blocks differ from the server's\n", bad, s_ctx->num_blocks);
+    else
+        printf("reassembled data : all %lu blocks match\n", s_ctx->num_blocks);
+}
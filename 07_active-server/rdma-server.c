@@ -3,8 +3,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/resource.h>
 #include <rdma/rdma_cma.h>
 #include "get_clock.h"
+#include "block_dir.h"
+#include "mr_cache.h"
+#include "permute.h"
+#include "region.h"
 
 #define TEST_NZ(x) do { if ( (x)) die("error: " #x " failed (returned non-zero)." ); } while (0)
 #define TEST_Z(x)  do { if (!(x)) die("error: " #x " failed (returned zero/null)."); } while (0)
@@ -12,8 +19,51 @@
 static const int RDMA_BUFFER_SIZE = 1 * 1024 * 1024;
 static const int DATA_BUFFER_SIZE = RDMA_BUFFER_SIZE;
 static int RDMA_BLOCK_SIZE; 
+/* requests a client may keep in flight */
+static int RDMA_SLOTS;
+/* send queue depth: every request may take MAX_RUNS writes and a finish message, with room to spare */
+static int RDMA_SEND_DEPTH;
+/* cq entries one connection can have outstanding: a send and a receive per slot, with room to spare */
+#define CQ_PER_CONN (4 * RDMA_SLOTS + 2)
+/* runs one write may gather; 1 unless -S asks for more, capped at what the device allows */
+int RDMA_MAX_SGE = 1;
+/* report each block with an RDMA_WRITE_WITH_IMM carrying its seq instead of a write + MSG_RDMA_WRITE_FINISH pair */
+int RDMA_WRITE_IMM = 0;
+/* stage every block in the local region before writing it, instead of writing straight out of app_data */
+int RDMA_COPY = 0;
+/* if set, a thread rewrites one block of app_data every UPDATE_US while serving */
+int UPDATE_US = 0;
 char *app_data;
-unsigned long *data_mapping_table;
+struct region app_region;
+unsigned long num_blocks;
+/* per block: writes of it the nic has not completed yet, and whether an update is waiting for them */
+unsigned int *block_inflight;
+int *block_updating;
+/* held while a block of app_data is copied, by the updater and by the staging path */
+pthread_mutex_t update_lock = PTHREAD_MUTEX_INITIALIZER;
+unsigned long updates, update_waits;
+/*
+ * each connection stages into its own pair of regions. a finished connection's
+ * pair goes on free_staging rather than being freed, so the next connection
+ * that takes it finds its registrations in the mr cache.
+ */
+struct staging {
+    struct region local_region;
+    struct region remote_region;
+    struct staging *next;
+};
+struct staging *free_staging;
+pthread_mutex_t staging_lock = PTHREAD_MUTEX_INITIALIZER;
+/* block id -> its place in app_data */
+struct block_dir data_dir;
+enum block_dir_kind DATA_DIR_KIND = BLOCK_DIR_DENSE;
+/* with -L, block i sits at a shuffled place in app_data, so a range of ids splits into runs for -S to gather */
+int SHUFFLE_BLOCKS = 0;
+
+cycles_t start;
+double cpu_start;
+unsigned long served_bytes;
+cycles_t serve_cycles;
 
 /*
     fix port:
@@ -25,11 +75,11 @@ unsigned long *data_mapping_table;
     send write data:
         func send_write_data
     look up data:
-        func look_up_addr
-    send post rdma post write:
+        func build_runs (data_dir)
+    send post rdma post write (chained with the write finish message):
         func send_post_rdma_write
-    send rdma write finish:
-        func send_mr_rdma_write_finish
+    build write finish message:
+        func build_message_wr
     Q:
         RDMA_BUFFER_SIZE need 1024 * 1024 * 1024 ?
 */
@@ -40,25 +90,47 @@ enum mode {
 };
 
 /* design message */
-struct message {
-    enum {
-        MSG_READ_DATA,
-        MSG_RDMA_WRITE_FINISH,
-        MSG_READ_DONE
-    } type;
-
-    union {
-        struct ibv_mr mr;
-        unsigned long index;
-    } data;
+enum {
+    MSG_READ_DATA,
+    MSG_RDMA_WRITE_FINISH,
+    MSG_READ_DONE,
+    MSG_READ_RANGE
 };
+
+#define MSG_VERSION 1
+#define MAX_WINDOW 64
+/* blocks one MSG_READ_RANGE may ask for */
+#define MAX_RANGE 64
+/* writes a request may be split into, each gathering up to RDMA_MAX_SGE runs, before it is staged whole instead */
+#define MAX_RUNS 4
+
+/* control message as it goes on the wire: fixed width, packed and small enough to send inline */
+struct message {
+    uint8_t version;
+    uint8_t type;
+    uint16_t reserved;
+    uint32_t rkey;
+    uint64_t addr;
+    uint32_t length;
+    uint32_t seq;
+    uint64_t index;
+} __attribute__((packed));
 /* end */
 
+/* a request whose writes are still outstanding; count is 0 if it was staged */
+struct served_request {
+    uint64_t first;
+    int count;
+    int staged;                 /* blocks from first whose staging spots this request holds */
+};
+
 struct context {
     struct ibv_context *ctx;
     struct ibv_pd *pd;
     struct ibv_cq *cq;
     struct ibv_comp_channel *comp_channel;
+    /* connections sharing the cq, which is grown to fit all of them */
+    int num_conns;
 
     pthread_t cq_poller_thread;
 };
@@ -67,18 +139,40 @@ struct connection {
     struct rdma_cm_id *id;
     struct ibv_qp *qp;
 
-    int connected;
+    /*
+     * block writes requested before ESTABLISHED are held back in pending_writes until on_connect
+     * posts them, and so are staged writes whose spots are still read by an earlier write
+     */
+    enum {
+        CONN_CONNECTING,
+        CONN_ESTABLISHED
+    } state;
+    pthread_mutex_t state_lock;
+    struct message *pending_writes;
+    int num_pending_writes;
+    /* set once a bad request has been seen; the connection is on its way down and serves nothing more */
+    int rejected;
+    double setup_cpu_us;
 
     struct ibv_mr *recv_mr;
     struct ibv_mr *send_mr;
     struct ibv_mr *rdma_local_mr;
     struct ibv_mr *rdma_remote_mr;
+    struct ibv_mr *app_mr;
 
-    struct ibv_mr peer_mr;
+    /* one entry per signaled send still outstanding, retired in order */
+    struct served_request *inflight_ring;
+    int ring_head;
+    int ring_tail;
+    /* per block: staged writes of this connection still reading its spot in the local region */
+    int *stage_busy;
 
+    /* RDMA_SLOTS receive buffers, consumed in the order they were posted */
     struct message *recv_msg;
+    int recv_head;
     struct message *send_msg;
 
+    struct staging *staging;
     char *rdma_local_region;
     char *rdma_remote_region;
 
@@ -105,9 +199,14 @@ static int on_connect_request(struct rdma_cm_id *id);
 static void build_connection(struct rdma_cm_id *id);
 static void build_context(struct ibv_context *verbs);
 static void * poll_cq(void *ctx);
+static void record_cq_batch(int n);
+static void print_cq_batch_hist(void);
+static int set_poll_mode(const char *name);
+static double cpu_seconds(void);
+static double thread_cpu_us(void);
 static void build_qp_attr(struct ibv_qp_init_attr *qp_attr);
 static void register_memory(struct connection *conn);
-static void post_receives(struct connection *conn);
+static void post_receive(struct connection *conn, int i);
 static void build_params(struct rdma_conn_param *params);
 
 static int on_connection(struct rdma_cm_id *id);
@@ -117,11 +216,31 @@ static int on_disconnect(struct rdma_cm_id *id);
 static void destroy_connection(void *context);
 
 static void on_completion(struct ibv_wc *wc);
-static void send_write_data(struct connection *conn, unsigned long index);
-static unsigned long look_up_addr(unsigned long *p, unsigned long index, unsigned long pre);
-static void send_post_rdma_write(struct connection *conn);
-static void send_mr_rdma_write_finish(void *context);
-static void send_message(struct connection *conn);
+static void send_write_data(struct connection *conn, struct message *req);
+static void reject_request(struct connection *conn, const char *reason);
+static void send_post_rdma_write(struct connection *conn, struct message *req);
+static void post_rdma_write(struct connection *conn, struct message *req);
+static int build_runs(struct connection *conn, struct message *req, struct ibv_sge *sge);
+static void retire_request(struct connection *conn);
+static void post_pending_writes(struct connection *conn);
+static void * update_blocks(void *arg);
+void update_block(unsigned long index, const char *src);
+static void build_message_wr(struct connection *conn, struct ibv_send_wr *wr, struct ibv_sge *sge);
+
+#define CQ_BATCH_HIST_SIZE 16
+
+int CQ_POLL_BATCH = 16;
+unsigned long cq_batch_hist[CQ_BATCH_HIST_SIZE];
+
+enum poll_mode {
+    POLL_EVENT,
+    POLL_BUSY,
+    POLL_HYBRID
+};
+
+static const char *poll_mode_names[] = { "event", "busy", "hybrid" };
+enum poll_mode CQ_POLL_MODE = POLL_EVENT;
+int CQ_SPIN_US = 50;
 
 static struct context *s_ctx = NULL;
 static enum mode s_mode = M_WRITE;
@@ -133,16 +252,76 @@ int main(int argc, char **argv)
     struct rdma_cm_id *listener = NULL;
     struct rdma_event_channel *ec = NULL;
     uint16_t port = 0;
+    int op;
+
+    while ((op = getopt(argc, argv, "c:P:u:H:O:N:F:M:ICLU:D:S:")) != -1) {
+        switch (op) {
+        case 'c':
+            TEST_Z(CQ_POLL_BATCH = atoi(optarg));
+            break;
+        case 'P':
+            if (set_poll_mode(optarg))
+                usage(argv[0]);
+            break;
+        case 'u':
+            CQ_SPIN_US = atoi(optarg);
+            break;
+        case 'H':
+            if (region_set_backend(optarg))
+                usage(argv[0]);
+            break;
+        case 'O':
+            if (region_set_reg_mode(optarg))
+                usage(argv[0]);
+            break;
+        case 'N':
+            if (region_set_numa(optarg))
+                usage(argv[0]);
+            break;
+        case 'F':
+            REGION_FILL_THREADS = atoi(optarg);
+            break;
+        case 'M':
+            TEST_Z(MR_CACHE_BUDGET = strtoul(optarg, NULL, 0) << 20);
+            break;
+        case 'I':
+            RDMA_WRITE_IMM = 1;
+            break;
+        case 'C':
+            RDMA_COPY = 1;
+            break;
+        case 'L':
+            SHUFFLE_BLOCKS = 1;
+            break;
+        case 'U':
+            TEST_Z(UPDATE_US = atoi(optarg));
+            break;
+        case 'D':
+            if (block_dir_parse_kind(optarg, &DATA_DIR_KIND))
+                usage(argv[0]);
+            break;
+        case 'S':
+            TEST_Z(RDMA_MAX_SGE = atoi(optarg));
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
 
-    if (argc != 4)
+    if (argc - optind != 3)
         usage(argv[0]);
+    /* argv[0] is about to be an operand; usage still wants the program name */
+    char *prog = argv[0];
+    argv += optind - 1;
 
     if (strcmp(argv[1], "write") == 0)
         set_mode(M_WRITE);
     else if (strcmp(argv[1], "read") == 0)
         set_mode(M_READ);
     else
-        usage(argv[0]);
+        usage(prog);
+    if (RDMA_WRITE_IMM && s_mode != M_WRITE)
+        usage(prog);
 
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
@@ -155,6 +334,13 @@ int main(int argc, char **argv)
     TEST_Z(RDMA_BLOCK_SIZE = atoi(argv[3]));
     /* end */
 
+    /* enough slots for the widest window a client with this block size will open */
+    RDMA_SLOTS = RDMA_BUFFER_SIZE / RDMA_BLOCK_SIZE;
+    if (RDMA_SLOTS > MAX_WINDOW)
+        RDMA_SLOTS = MAX_WINDOW;
+    TEST_Z(RDMA_SLOTS);
+    RDMA_SEND_DEPTH = 2 * (MAX_RUNS + 1) * RDMA_SLOTS;
+
     TEST_Z(ec = rdma_create_event_channel());
     TEST_NZ(rdma_create_id(ec, &listener, NULL, RDMA_PS_TCP));
     TEST_NZ(rdma_bind_addr(listener, (struct sockaddr *)&addr));
@@ -182,7 +368,7 @@ int main(int argc, char **argv)
 
 void usage(const char *argv0)
 {
-    fprintf(stderr, "usage: %s <mode> <port> <block-size> \n  mode = \"read\", \"write\"\n", argv0);
+    fprintf(stderr, "usage: %s [-c cq-poll-batch] [-P poll-mode] [-u spin-us] [-H pages] [-O reg] [-N numa-node] [-F fill-threads] [-M mr-cache-MB] [-I] [-C] [-L] [-U update-us] [-D dir] [-S max-sge] <mode> <port> <block-size> \n  mode = \"read\", \"write\"\n  poll-mode = \"event\", \"busy\", \"hybrid\"\n  pages = \"malloc\", \"2m\", \"1g\" or a hugetlbfs mount\n  reg = \"pinned\", \"odp\", \"implicit\"\n  numa-node = node number or \"off\", default is the node of the device\n  fill-threads = threads that first touch the buffers, default one per cpu of the node\n  -I = report blocks with a write immediate, write mode only\n  -C = copy blocks into the staging region before writing them, read mode always does\n  -L = lay the blocks out in app data in a shuffled order instead of by id\n  update-us = rewrite a block of app data this often while serving\n  dir = \"dense\", \"hash\", how block ids are looked up\n  max-sge = runs gathered into one write, default 1, at most what the device allows\n", argv0);
     exit(1);
 }
 
@@ -200,6 +386,7 @@ void die(const char *reason)
 int on_event(struct rdma_cm_event *event)
 {
     int r = 0;
+    double cpu = thread_cpu_us();
 
     if (event->event == RDMA_CM_EVENT_CONNECT_REQUEST)
         r = on_connect_request(event->id);
@@ -210,6 +397,15 @@ int on_event(struct rdma_cm_event *event)
     else
         die("on_event: unknown event.");
 
+    /* what the cm thread spends on a connection until it is established is its setup cost */
+    if (event->event == RDMA_CM_EVENT_CONNECT_REQUEST || event->event == RDMA_CM_EVENT_ESTABLISHED) {
+        struct connection *conn = (struct connection *)event->id->context;
+
+        conn->setup_cpu_us += thread_cpu_us() - cpu;
+        if (event->event == RDMA_CM_EVENT_ESTABLISHED)
+            printf("connection set up with %lf us of cpu.\n", conn->setup_cpu_us);
+    }
+
     return r;
 }
 
@@ -233,6 +429,11 @@ void build_connection(struct rdma_cm_id *id)
     build_context(id->verbs);
     build_qp_attr(&qp_attr);
 
+    /* an overrun cq is fatal, so grow it before another qp can complete into it */
+    int cqe = __atomic_add_fetch(&s_ctx->num_conns, 1, __ATOMIC_SEQ_CST) * CQ_PER_CONN;
+    if (s_ctx->cq->cqe < cqe)
+        TEST_NZ(ibv_resize_cq(s_ctx->cq, cqe));
+
     TEST_NZ(rdma_create_qp(id, s_ctx->pd, &qp_attr));
 
     id->context = conn = (struct connection *)malloc(sizeof(struct connection));
@@ -243,10 +444,18 @@ void build_connection(struct rdma_cm_id *id)
     conn->send_state = SS_INIT;
     conn->recv_state = RS_INIT;
 
-    conn->connected = 0;
+    conn->state = CONN_CONNECTING;
+    conn->rejected = 0;
+    TEST_NZ(pthread_mutex_init(&conn->state_lock, NULL));
+    TEST_Z(conn->pending_writes = calloc(RDMA_SLOTS, sizeof(struct message)));
+    conn->num_pending_writes = 0;
+    TEST_Z(conn->inflight_ring = calloc(RDMA_SEND_DEPTH, sizeof(struct served_request)));
+    conn->ring_head = conn->ring_tail = 0;
+    conn->setup_cpu_us = 0;
 
     register_memory(conn);
-    post_receives(conn);
+    for (int i = 0; i < RDMA_SLOTS; i++)
+        post_receive(conn, i);
 }
 
 void build_context(struct ibv_context *verbs)
@@ -261,27 +470,130 @@ void build_context(struct ibv_context *verbs)
     s_ctx = (struct context *)malloc(sizeof(struct context));
 
     s_ctx->ctx = verbs;
+    region_place(s_ctx->ctx);
+    region_report_placement();
+
+    /* a write can gather at most max_sge buffers; a read scatters into at most max_sge_rd */
+    if (RDMA_MAX_SGE > 1) {
+        struct ibv_device_attr attr;
+        int max_sge;
+
+        TEST_NZ(ibv_query_device(s_ctx->ctx, &attr));
+        max_sge = (s_mode == M_WRITE) ? attr.max_sge : attr.max_sge_rd;
+        if (max_sge > MAX_RANGE)
+            max_sge = MAX_RANGE;
+        if (RDMA_MAX_SGE > max_sge)
+            RDMA_MAX_SGE = max_sge;
+        TEST_Z(RDMA_MAX_SGE);
+    }
+    printf("gathering up to %d runs per write\n", RDMA_MAX_SGE);
 
     TEST_Z(s_ctx->pd = ibv_alloc_pd(s_ctx->ctx));
     TEST_Z(s_ctx->comp_channel = ibv_create_comp_channel(s_ctx->ctx));
-    TEST_Z(s_ctx->cq = ibv_create_cq(s_ctx->ctx, 10, NULL, s_ctx->comp_channel, 0)); /* cqe=10 is arbitrary */
-    TEST_NZ(ibv_req_notify_cq(s_ctx->cq, 0));
+    TEST_Z(s_ctx->cq = ibv_create_cq(s_ctx->ctx, CQ_PER_CONN, NULL, s_ctx->comp_channel, 0));
+    s_ctx->num_conns = 0;
 
     TEST_NZ(pthread_create(&s_ctx->cq_poller_thread, NULL, poll_cq, NULL));
+    if (region_pin_thread(s_ctx->cq_poller_thread) == 0)
+        printf("cq poller pinned to the placement node\n");
 }
 
+/* bucket i counts polls that drained [2^i, 2^(i+1)) completions at once */
+void record_cq_batch(int n)
+{
+    int i = 0;
+
+    while (n >>= 1)
+        i++;
+    if (i >= CQ_BATCH_HIST_SIZE)
+        i = CQ_BATCH_HIST_SIZE - 1;
+    cq_batch_hist[i]++;
+}
+
+void print_cq_batch_hist(void)
+{
+    printf("cq poll batch histogram (batch %d):\n", CQ_POLL_BATCH);
+    for (int i = 0; i < CQ_BATCH_HIST_SIZE; i++) {
+        if (cq_batch_hist[i])
+            printf("  %5d - %5d : %lu\n", 1 << i, (1 << (i + 1)) - 1, cq_batch_hist[i]);
+    }
+}
+
+int set_poll_mode(const char *name)
+{
+    for (int i = 0; i < sizeof(poll_mode_names) / sizeof(poll_mode_names[0]); i++) {
+        if (strcmp(name, poll_mode_names[i]) == 0) {
+            CQ_POLL_MODE = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* user + system time of the whole process, so it covers the poller thread too */
+double cpu_seconds(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+double thread_cpu_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+/*
+ * POLL_EVENT  : sleep on the completion channel whenever the cq is empty
+ * POLL_BUSY   : never arm the cq, spin on ibv_poll_cq
+ * POLL_HYBRID : spin for CQ_SPIN_US after the last completion, then arm and sleep
+ */
 void * poll_cq(void *ctx)
 {
-    struct ibv_cq *cq;
-    struct ibv_wc wc;
+    struct ibv_cq *cq = s_ctx->cq;
+    struct ibv_wc *wc;
+    cycles_t idle_start = get_cycles();
+    cycles_t spin_cycles = 0;
+    int armed = 0;
+    int n;
+
+    TEST_Z(wc = calloc(CQ_POLL_BATCH, sizeof(struct ibv_wc)));
+    if (CQ_POLL_MODE == POLL_HYBRID)
+        spin_cycles = get_cpu_mhz(0) * CQ_SPIN_US;
 
     while (1) {
+        if ((n = ibv_poll_cq(cq, CQ_POLL_BATCH, wc)) < 0)
+            die("poll_cq: ibv_poll_cq failed.");
+
+        if (n > 0) {
+            record_cq_batch(n);
+            for (int i = 0; i < n; i++)
+                on_completion(&wc[i]);
+            idle_start = get_cycles();
+            armed = 0;
+            continue;
+        }
+
+        if (CQ_POLL_MODE == POLL_BUSY)
+            continue;
+        if (CQ_POLL_MODE == POLL_HYBRID && get_cycles() - idle_start < spin_cycles)
+            continue;
+
+        /* arm, then poll once more so a completion racing the arm is not slept through */
+        if (!armed) {
+            TEST_NZ(ibv_req_notify_cq(cq, 0));
+            armed = 1;
+            continue;
+        }
+
         TEST_NZ(ibv_get_cq_event(s_ctx->comp_channel, &cq, &ctx));
         ibv_ack_cq_events(cq, 1);
-        TEST_NZ(ibv_req_notify_cq(cq, 0));
-
-        while (ibv_poll_cq(cq, 1, &wc))
-            on_completion(&wc);
+        idle_start = get_cycles();
+        armed = 0;
     }
 
     return NULL;
@@ -295,37 +607,59 @@ void build_qp_attr(struct ibv_qp_init_attr *qp_attr)
     qp_attr->recv_cq = s_ctx->cq;
     qp_attr->qp_type = IBV_QPT_RC;
 
-    qp_attr->cap.max_send_wr = 10;
-    qp_attr->cap.max_recv_wr = 10;
-    qp_attr->cap.max_send_sge = 1;
+    qp_attr->cap.max_send_wr = RDMA_SEND_DEPTH;
+    qp_attr->cap.max_recv_wr = RDMA_SLOTS;
+    qp_attr->cap.max_send_sge = RDMA_MAX_SGE;
     qp_attr->cap.max_recv_sge = 1;
+    qp_attr->cap.max_inline_data = sizeof(struct message);
 }
 
 void register_memory(struct connection *conn)
 {
-    /* build app data with mapping table */
-    unsigned long i, j;
-    app_data = malloc(DATA_BUFFER_SIZE);
-    for (i = 0, j = 0; i < DATA_BUFFER_SIZE; i++, j++) {
-        *(app_data + i) = 'a' + j;
-        if (j == 15)
-            j = -1;
+    /* build app data with mapping table, once for every connection */
+    if (!app_data) {
+        unsigned long i;
+        struct permute place;
+        TEST_Z(app_data = region_alloc(&app_region, DATA_BUFFER_SIZE));
+        region_fill(&app_region, DATA_BUFFER_SIZE, "abcdefghijklmnop", 16);
+        region_report("app data", &app_region);
+
+        num_blocks = DATA_BUFFER_SIZE / RDMA_BLOCK_SIZE;
+        permute_init(&place, num_blocks, 1);
+        TEST_NZ(block_dir_init(&data_dir, DATA_DIR_KIND, num_blocks));
+        for (i = 0; i < num_blocks; i++)
+            TEST_NZ(block_dir_insert(&data_dir, i, app_data + (SHUFFLE_BLOCKS ? permute_at(&place, i) : i) * RDMA_BLOCK_SIZE, RDMA_BLOCK_SIZE));
+        printf("block directory : %s, %lu blocks, %s\n", block_dir_names[DATA_DIR_KIND], (unsigned long)data_dir.count,
+            SHUFFLE_BLOCKS ? "shuffled" : "in id order");
+        TEST_Z(block_inflight = calloc(num_blocks, sizeof(unsigned int)));
+        TEST_Z(block_updating = calloc(num_blocks, sizeof(int)));
+
+        if (UPDATE_US) {
+            pthread_t updater;
+
+            TEST_NZ(pthread_create(&updater, NULL, update_blocks, NULL));
+            TEST_NZ(pthread_detach(updater));
+        }
     }
+    /* end */
 
-    unsigned long num_entries = DATA_BUFFER_SIZE / RDMA_BLOCK_SIZE;
-    data_mapping_table = malloc(num_entries * 8);
-    unsigned long *p = data_mapping_table;
-    for (i = 0; i < num_entries; i++) {
-        *p = (unsigned long)(app_data + i * RDMA_BLOCK_SIZE);
-        p++;
+    pthread_mutex_lock(&staging_lock);
+    if ((conn->staging = free_staging))
+        free_staging = conn->staging->next;
+    pthread_mutex_unlock(&staging_lock);
+    if (!conn->staging) {
+        TEST_Z(conn->staging = calloc(1, sizeof(struct staging)));
+        TEST_Z(region_alloc(&conn->staging->local_region, RDMA_BUFFER_SIZE));
+        TEST_Z(region_alloc(&conn->staging->remote_region, RDMA_BUFFER_SIZE));
     }
-    /* end */
+    TEST_Z(conn->stage_busy = calloc(num_blocks, sizeof(int)));
 
-    conn->send_msg = malloc(sizeof(struct message));
-    conn->recv_msg = malloc(sizeof(struct message));
+    conn->send_msg = calloc(1, sizeof(struct message));
+    conn->recv_msg = calloc(RDMA_SLOTS, sizeof(struct message));
+    conn->recv_head = 0;
 
-    conn->rdma_local_region = malloc(RDMA_BUFFER_SIZE);
-    conn->rdma_remote_region = malloc(RDMA_BUFFER_SIZE);
+    conn->rdma_local_region = conn->staging->local_region.addr;
+    conn->rdma_remote_region = conn->staging->remote_region.addr;
 
     TEST_Z(conn->send_mr = ibv_reg_mr(
     s_ctx->pd, 
@@ -336,23 +670,30 @@ void register_memory(struct connection *conn)
     TEST_Z(conn->recv_mr = ibv_reg_mr(
     s_ctx->pd, 
     conn->recv_msg, 
-    sizeof(struct message), 
+    RDMA_SLOTS * sizeof(struct message), 
     IBV_ACCESS_LOCAL_WRITE | ((s_mode == M_WRITE) ? IBV_ACCESS_REMOTE_WRITE : IBV_ACCESS_REMOTE_READ)));
 
-    TEST_Z(conn->rdma_local_mr = ibv_reg_mr(
+    TEST_Z(conn->rdma_local_mr = region_reg_mr(
+    &conn->staging->local_region, 
     s_ctx->pd, 
-    conn->rdma_local_region, 
-    RDMA_BUFFER_SIZE, 
     IBV_ACCESS_LOCAL_WRITE));
 
-    TEST_Z(conn->rdma_remote_mr = ibv_reg_mr(
+    TEST_Z(conn->rdma_remote_mr = region_reg_mr(
+    &conn->staging->remote_region, 
     s_ctx->pd, 
-    conn->rdma_remote_region, 
-    RDMA_BUFFER_SIZE, 
     IBV_ACCESS_LOCAL_WRITE | ((s_mode == M_WRITE) ? IBV_ACCESS_REMOTE_WRITE : IBV_ACCESS_REMOTE_READ)));
+
+    /* source of the zero copy writes */
+    TEST_Z(conn->app_mr = region_reg_mr(
+    &app_region, 
+    s_ctx->pd, 
+    IBV_ACCESS_LOCAL_WRITE));
+
+    region_report("local region", &conn->staging->local_region);
+    region_report("remote region", &conn->staging->remote_region);
 }
 
-void post_receives(struct connection *conn)
+void post_receive(struct connection *conn, int i)
 {
     struct ibv_recv_wr wr, *bad_wr = NULL;
     struct ibv_sge sge;
@@ -362,7 +703,7 @@ void post_receives(struct connection *conn)
     wr.sg_list = &sge;
     wr.num_sge = 1;
 
-    sge.addr = (uintptr_t)conn->recv_msg;
+    sge.addr = (uintptr_t)&conn->recv_msg[i];
     sge.length = sizeof(struct message);
     sge.lkey = conn->recv_mr->lkey;
 
@@ -379,6 +720,10 @@ void build_params(struct rdma_conn_param *params)
 
 int on_connection(struct rdma_cm_id *id)
 {
+    cpu_start = cpu_seconds();
+    start = get_cycles();
+    served_bytes = 0;
+    serve_cycles = 0;
     on_connect(id->context);
 
     return 0;
@@ -386,14 +731,44 @@ int on_connection(struct rdma_cm_id *id)
 
 void on_connect(void *context)
 {
-    ((struct connection *)context)->connected = 1;
+    struct connection *conn = (struct connection *)context;
+
+    pthread_mutex_lock(&conn->state_lock);
+    conn->state = CONN_ESTABLISHED;
+    post_pending_writes(conn);
+    pthread_mutex_unlock(&conn->state_lock);
+}
+
+/* post the held back writes in order; any that still find their spots busy go back on the list */
+void post_pending_writes(struct connection *conn)
+{
+    int num = conn->num_pending_writes;
+
+    conn->num_pending_writes = 0;
+    for (int i = 0; i < num; i++)
+        post_rdma_write(conn, &conn->pending_writes[i]);
 }
 
 int on_disconnect(struct rdma_cm_id *id)
 {
+    double wall_time = (get_cycles() - start) / (get_cpu_mhz(0) * 1000000);
+
     printf("peer disconnected.\n");
+    printf("poll mode : %s, connection time : %lf s, cpu usage : %lf %%\n", poll_mode_names[CQ_POLL_MODE], wall_time, (cpu_seconds() - cpu_start) * 100 / wall_time);
+    if (served_bytes) {
+        double cycles_per_unit = get_cpu_mhz(0) * 1000000;
+
+        printf("served %lu bytes %s, serve path : %lf cycles/byte, process : %lf cycles/byte\n",
+            served_bytes, (RDMA_COPY || s_mode != M_WRITE) ? "through the staging region" : "zero copy",
+            (double)serve_cycles / served_bytes,
+            (cpu_seconds() - cpu_start) * cycles_per_unit / served_bytes);
+    }
+    if (UPDATE_US)
+        printf("block updates : %lu, waited on in flight writes : %lu\n", updates, update_waits);
+    print_cq_batch_hist();
 
     destroy_connection(id->context);
+    mr_cache_report();
     return 0;
 }
 
@@ -402,19 +777,32 @@ void destroy_connection(void *context)
     struct connection *conn = (struct connection *)context;
 
     rdma_destroy_qp(conn->id);
+    __atomic_sub_fetch(&s_ctx->num_conns, 1, __ATOMIC_SEQ_CST);
 
     ibv_dereg_mr(conn->send_mr);
     ibv_dereg_mr(conn->recv_mr);
-    ibv_dereg_mr(conn->rdma_local_mr);
-    ibv_dereg_mr(conn->rdma_remote_mr);
+    region_dereg_mr(&conn->staging->local_region, conn->rdma_local_mr);
+    region_dereg_mr(&conn->staging->remote_region, conn->rdma_remote_mr);
+    region_dereg_mr(&app_region, conn->app_mr);
+
+    pthread_mutex_lock(&staging_lock);
+    conn->staging->next = free_staging;
+    free_staging = conn->staging;
+    pthread_mutex_unlock(&staging_lock);
+
+    /* whatever never completed is no longer read by the nic either */
+    while (conn->ring_head != conn->ring_tail)
+        retire_request(conn);
+    free(conn->inflight_ring);
+    free(conn->stage_busy);
 
     free(conn->send_msg);
     free(conn->recv_msg);
-    free(conn->rdma_local_region);
-    free(conn->rdma_remote_region);
 
     rdma_destroy_id(conn->id);
 
+    free(conn->pending_writes);
+    pthread_mutex_destroy(&conn->state_lock);
     free(conn);
 }
 
@@ -422,94 +810,276 @@ void on_completion(struct ibv_wc *wc)
 {
     struct connection *conn = (struct connection *)(uintptr_t)wc->wr_id;
 
+    /* the qp of a rejected connection flushes what it still had posted; conn may already be gone */
+    if (wc->status == IBV_WC_WR_FLUSH_ERR)
+        return;
     if (wc->status != IBV_WC_SUCCESS)
         die("on_completion: status is not IBV_WC_SUCCESS.");
 
     if (wc->opcode & IBV_WC_RECV) {
-        if (conn->recv_msg->type == MSG_READ_DATA) {
-            memcpy(&conn->peer_mr, &conn->recv_msg->data.mr, sizeof(conn->peer_mr));
-            send_write_data(conn, conn->recv_msg->data.index);
-            send_mr_rdma_write_finish(conn);
-            conn->send_state = SS_DONE_SENT;
+        struct message *msg = &conn->recv_msg[conn->recv_head];
+
+        if (conn->rejected)
+            return;
+        if (msg->version != MSG_VERSION) {
+            reject_request(conn, "unknown message version");
+            return;
         }
-        if (conn->recv_msg->type == MSG_READ_DONE) {
+
+        if (msg->type == MSG_READ_DONE) {
             on_disconnect(conn->id);
+            return;
         }
-    } else {
-        if (conn->send_state == SS_DONE_SENT){
-            post_receives(conn);
-            conn->send_state = SS_INIT;
-        }
+        /* every request is served as soon as it arrives, whatever else is still in flight */
+        if (msg->type == MSG_READ_DATA || msg->type == MSG_READ_RANGE)
+            send_write_data(conn, msg);
+
+        post_receive(conn, conn->recv_head);
+        conn->recv_head = (conn->recv_head + 1) % RDMA_SLOTS;
+    } else if (wc->opcode == IBV_WC_SEND || wc->opcode == IBV_WC_RDMA_WRITE) {
+        /* one signaled send per request, so this one ends the oldest request's writes */
+        retire_request(conn);
+
+        pthread_mutex_lock(&conn->state_lock);
+        if (conn->state == CONN_ESTABLISHED && !conn->rejected && conn->num_pending_writes)
+            post_pending_writes(conn);
+        pthread_mutex_unlock(&conn->state_lock);
     }
 }
 
-void send_write_data(struct connection *conn, unsigned long index)
+void send_write_data(struct connection *conn, struct message *req)
 {
-    char *data_addr = (char *)look_up_addr(data_mapping_table, index, index);
-    printf("data addr : %lx \n", (unsigned long)data_addr);
-    memcpy(conn->rdma_local_region, data_addr, RDMA_BLOCK_SIZE);
-    send_post_rdma_write(conn);
+    cycles_t t = get_cycles();
+    unsigned long count = req->length / RDMA_BLOCK_SIZE;
+
+    if (req->length % RDMA_BLOCK_SIZE || count == 0 || count > MAX_RANGE || (req->type == MSG_READ_DATA && count != 1)) {
+        reject_request(conn, "bad request length");
+        return;
+    }
+    if (req->index >= num_blocks || count > num_blocks - req->index) {
+        reject_request(conn, "no such block");
+        return;
+    }
+    for (unsigned long i = 0; i < count; i++) {
+        if (!block_dir_find(&data_dir, req->index + i)) {
+            reject_request(conn, "no such block");
+            return;
+        }
+    }
+
+    send_post_rdma_write(conn, req);
+    serve_cycles += get_cycles() - t;
+    served_bytes += req->length;
 }
 
-unsigned long look_up_addr(unsigned long *p, unsigned long index, unsigned long pre)
+/* a bad request only costs its own client the connection: the other clients keep being served */
+void reject_request(struct connection *conn, const char *reason)
 {
-    while (pre != index) {
-        pre++;
-        if (pre >= DATA_BUFFER_SIZE)
-            pre = 0;
-    }
-    return *(p + pre);
-} 
+    fprintf(stderr, "rejecting request: %s, disconnecting the client.\n", reason);
+    if (!__atomic_exchange_n(&conn->rejected, 1, __ATOMIC_SEQ_CST))
+        rdma_disconnect(conn->id);
+}
 
-void send_post_rdma_write(struct connection *conn)
+/*
+ * split a request into runs of blocks that lie back to back in memory, one sge each.
+ * zero copy runs go straight out of app_data and keep their blocks in flight until the
+ * request completes. in read mode, with -C, when a block has an update waiting or when
+ * the runs would need more than MAX_RUNS writes, the whole range is copied to its own
+ * place in the local region instead and goes out as a single run. that place is held
+ * until the request completes; returns 0 if an earlier write still holds it
+ */
+int build_runs(struct connection *conn, struct message *req, struct ibv_sge *sge)
 {
-    struct ibv_send_wr wr, *bad_wr = NULL;
-    struct ibv_sge sge;
+    struct served_request *r = &conn->inflight_ring[conn->ring_tail];
+    int count = req->length / RDMA_BLOCK_SIZE;
+    char *stage = conn->rdma_local_region + req->index * RDMA_BLOCK_SIZE;
+    int i, n = 0;
+
+    r->first = req->index;
+    r->count = 0;
+    r->staged = 0;
+
+    /* count the writes before looking at the flags, so an updater either sees them or is seen */
+    if (s_mode == M_WRITE && !RDMA_COPY) {
+        int updating = 0;
+
+        for (i = 0; i < count; i++) {
+            __atomic_add_fetch(&block_inflight[req->index + i], 1, __ATOMIC_SEQ_CST);
+            updating |= __atomic_load_n(&block_updating[req->index + i], __ATOMIC_SEQ_CST);
+        }
 
-    memset(&wr, 0, sizeof(wr));
+        for (i = 0; !updating && i < count; i++) {
+            struct block_dir_entry *e = block_dir_find(&data_dir, req->index + i);
+
+            if (n && sge[n - 1].addr + sge[n - 1].length == (uintptr_t)e->addr) {
+                sge[n - 1].length += RDMA_BLOCK_SIZE;
+                continue;
+            }
+            sge[n].addr = (uintptr_t)e->addr;
+            sge[n].length = RDMA_BLOCK_SIZE;
+            sge[n].lkey = conn->app_mr->lkey;
+            n++;
+        }
+        if (!updating && n <= MAX_RUNS * RDMA_MAX_SGE) {
+            r->count = count;
+            return n;
+        }
 
-    wr.wr_id = (uintptr_t)conn;
-    wr.opcode = (s_mode == M_WRITE) ? IBV_WR_RDMA_WRITE : IBV_WR_RDMA_READ;
-    wr.sg_list = &sge;
-    wr.num_sge = 1;
-    wr.send_flags = IBV_SEND_SIGNALED;
-    wr.wr.rdma.remote_addr = (uintptr_t)conn->peer_mr.addr;
-    wr.wr.rdma.rkey = conn->peer_mr.rkey;
+        for (i = 0; i < count; i++)
+            __atomic_sub_fetch(&block_inflight[req->index + i], 1, __ATOMIC_SEQ_CST);
+    }
 
-    sge.addr = (uintptr_t)conn->rdma_local_region;
-    sge.length = RDMA_BLOCK_SIZE;
-    sge.lkey = conn->rdma_local_mr->lkey;
+    for (i = 0; i < count; i++) {
+        if (conn->stage_busy[req->index + i])
+            return 0;
+    }
+    for (i = 0; i < count; i++)
+        conn->stage_busy[req->index + i]++;
+    r->staged = count;
+
+    pthread_mutex_lock(&update_lock);
+    for (i = 0; i < count; i++)
+        memcpy(stage + i * RDMA_BLOCK_SIZE, block_dir_find(&data_dir, req->index + i)->addr, RDMA_BLOCK_SIZE);
+    pthread_mutex_unlock(&update_lock);
+
+    sge[0].addr = (uintptr_t)stage;
+    sge[0].length = count * RDMA_BLOCK_SIZE;
+    sge[0].lkey = conn->rdma_local_mr->lkey;
+    return 1;
+}
+
+void retire_request(struct connection *conn)
+{
+    struct served_request *r = &conn->inflight_ring[conn->ring_head];
 
-    TEST_NZ(ibv_post_send(conn->qp, &wr, &bad_wr));
+    for (int i = 0; i < r->count; i++)
+        __atomic_sub_fetch(&block_inflight[r->first + i], 1, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < r->staged; i++)
+        conn->stage_busy[r->first + i]--;
+    conn->ring_head = (conn->ring_head + 1) % RDMA_SEND_DEPTH;
 }
 
-void send_mr_rdma_write_finish(void *context)
+/*
+ * update policy: a block is never rewritten under a write the nic may still be reading.
+ * the block is flagged first, so new requests for it are staged, then the update waits for
+ * the writes in flight to complete and copies under update_lock
+ */
+void update_block(unsigned long index, const char *src)
 {
-    struct connection *conn = (struct connection *)context;
+    __atomic_store_n(&block_updating[index], 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&block_inflight[index], __ATOMIC_SEQ_CST))
+        update_waits++;
+    while (__atomic_load_n(&block_inflight[index], __ATOMIC_SEQ_CST))
+        sched_yield();
+
+    pthread_mutex_lock(&update_lock);
+    memcpy(block_dir_find(&data_dir, index)->addr, src, RDMA_BLOCK_SIZE);
+    pthread_mutex_unlock(&update_lock);
+
+    __atomic_store_n(&block_updating[index], 0, __ATOMIC_SEQ_CST);
+    updates++;
+}
 
-    conn->send_msg->type = MSG_RDMA_WRITE_FINISH;
+/* walks app_data rewriting each block with its own contents, so what the client reads stays valid */
+void * update_blocks(void *arg)
+{
+    unsigned long i = 0;
+    char *buf;
+
+    TEST_Z(buf = malloc(RDMA_BLOCK_SIZE));
+    while (1) {
+        memcpy(buf, block_dir_find(&data_dir, i)->addr, RDMA_BLOCK_SIZE);
+        update_block(i, buf);
+        i = (i + 1) % num_blocks;
+        usleep(UPDATE_US);
+    }
 
-    send_message(conn);
+    return NULL;
 }
 
-void send_message(struct connection *conn)
+void send_post_rdma_write(struct connection *conn, struct message *req)
 {
-    struct ibv_send_wr wr, *bad_wr = NULL;
-    struct ibv_sge sge;
+    pthread_mutex_lock(&conn->state_lock);
+    if (conn->state == CONN_ESTABLISHED)
+        post_rdma_write(conn, req);
+    else if (conn->num_pending_writes < RDMA_SLOTS)
+        conn->pending_writes[conn->num_pending_writes++] = *req;
+    else
+        reject_request(conn, "too many requests before the connection was established");
+    pthread_mutex_unlock(&conn->state_lock);
+}
 
-    memset(&wr, 0, sizeof(wr));
+/*
+ * post the runs, RDMA_MAX_SGE to a write, and the MSG_RDMA_WRITE_FINISH as one chain: one doorbell per request.
+ * only the SEND is signaled; its completion also retires the writes queued before it.
+ * the finish message echoes seq and index, which is how the client matches the request.
+ * with -I the last write carries seq as its immediate and no finish message is sent
+ */
+void post_rdma_write(struct connection *conn, struct message *req)
+{
+    struct ibv_send_wr wr[MAX_RUNS + 1], *bad_wr = NULL;
+    struct ibv_sge sge[MAX_RANGE + 1];
+    uint64_t remote_addr = req->addr;
+    int n = build_runs(conn, req, sge);
+    int num_wr = 0;
+
+    if (!n) {
+        if (conn->num_pending_writes == RDMA_SLOTS)
+            reject_request(conn, "too many requests held back");
+        else
+            conn->pending_writes[conn->num_pending_writes++] = *req;
+        return;
+    }
+    conn->ring_tail = (conn->ring_tail + 1) % RDMA_SEND_DEPTH;
 
-    wr.wr_id = (uintptr_t)conn;
-    wr.opcode = IBV_WR_SEND;
-    wr.sg_list = &sge;
-    wr.num_sge = 1;
-    wr.send_flags = IBV_SEND_SIGNALED;
+    /* the range is contiguous on the client, so each write lands right after the one before */
+    for (int i = 0; i < n; i += RDMA_MAX_SGE) {
+        struct ibv_send_wr *w = &wr[num_wr++];
 
-    sge.addr = (uintptr_t)conn->send_msg;
-    sge.length = sizeof(struct message);
-    sge.lkey = conn->send_mr->lkey;
+        memset(w, 0, sizeof(*w));
+
+        w->wr_id = (uintptr_t)conn;
+        w->opcode = (s_mode == M_WRITE) ? IBV_WR_RDMA_WRITE : IBV_WR_RDMA_READ;
+        w->sg_list = &sge[i];
+        w->num_sge = (n - i < RDMA_MAX_SGE) ? n - i : RDMA_MAX_SGE;
+        w->wr.rdma.remote_addr = remote_addr;
+        w->wr.rdma.rkey = req->rkey;
+        w->next = &wr[num_wr];
+
+        for (int j = 0; j < w->num_sge; j++)
+            remote_addr += sge[i + j].length;
+    }
+
+    /* one client cqe per request: the immediate tells the client which request landed */
+    if (RDMA_WRITE_IMM) {
+        wr[num_wr - 1].opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+        wr[num_wr - 1].imm_data = htonl(req->seq);
+        wr[num_wr - 1].send_flags = IBV_SEND_SIGNALED;
+        wr[num_wr - 1].next = NULL;
+        TEST_NZ(ibv_post_send(conn->qp, wr, &bad_wr));
+        return;
+    }
+
+    conn->send_msg->version = MSG_VERSION;
+    conn->send_msg->type = MSG_RDMA_WRITE_FINISH;
+    conn->send_msg->seq = req->seq;
+    conn->send_msg->index = req->index;
+    build_message_wr(conn, &wr[num_wr], &sge[n]);
+
+    TEST_NZ(ibv_post_send(conn->qp, wr, &bad_wr));
+}
+
+void build_message_wr(struct connection *conn, struct ibv_send_wr *wr, struct ibv_sge *sge)
+{
+    memset(wr, 0, sizeof(*wr));
 
-    while (!conn->connected);
+    wr->wr_id = (uintptr_t)conn;
+    wr->opcode = IBV_WR_SEND;
+    wr->sg_list = sge;
+    wr->num_sge = 1;
+    wr->send_flags = IBV_SEND_SIGNALED | IBV_SEND_INLINE;
 
-    TEST_NZ(ibv_post_send(conn->qp, &wr, &bad_wr));
+    sge->addr = (uintptr_t)conn->send_msg;
+    sge->length = sizeof(struct message);
+    sge->lkey = conn->send_mr->lkey;
 }
\ No newline at end of file